@@ -12,6 +12,7 @@ typedef	unsigned short	int		word;
 typedef	unsigned		int		dword;
 typedef					int		sdword;
 typedef	unsigned		int		uint;
+typedef	unsigned long	long	qword;
 #pragma endregion
 
 #pragma region Utility Functions
@@ -33,6 +34,7 @@ inline float vlen	(vec2 v)			{ return (float)sqrt(vlen2(v)); }
 inline float vdot	(vec2 v1, vec2 v2)	{ return v1.x * v2.x + v1.y + v2.y; }
 inline vec2	 vunit	(float angle)		{ return vmake((float)cos(angle), (float)sin(angle)); }
 inline vec2	 vunit	(vec2 v)			{ return vscale(v, 1.f/vlen(v)); }
+inline vec2	 vlerp	(vec2 v1, vec2 v2, float t) { return vadd(v1, vscale(vsub(v2, v1), t)); }
 #pragma endregion
 
 #endif // !P7_BASE_H_
\ No newline at end of file
@@ -4,180 +4,2157 @@
 #include "stdafx.h"
 #include "base.h"
 #include "core.h"
+#include "sys.h"
+
+//=============================================================================
+// Random generation
+
+CORE_RandState CORE_RandStreams[CORE_RAND_STREAMS];
+
+//-----------------------------------------------------------------------------
+void CORE_SeedRand(unsigned seed)
+{
+	for ( int i = 0; i < CORE_RAND_STREAMS; i++ )
+	{
+		// Standard PCG32 seeding, the stream index selects the sequence
+		CORE_RandState &rs = CORE_RandStreams[i];
+		rs.state = 0;
+		rs.inc = ((qword)i << 1) | 1;
+		CORE_Rand32(i);
+		rs.state += seed;
+		CORE_Rand32(i);
+	}
+}
+
+// Same start as CORE_SeedRand(1) for code that never seeds
+static struct CORE_RandDefaultSeed { CORE_RandDefaultSeed() { CORE_SeedRand(1); } } CORE_rand_default_seed;
+
+//-----------------------------------------------------------------------------
+void CORE_FRandFill(float out[], size_t n, float from, float to, int stream)
+{
+	// Local copy of the state so the loop keeps it in registers
+	CORE_RandState rs = CORE_RandStreams[stream];
+	float scale = (to - from) * (1.f / 16777216.f);
+	for ( size_t i = 0; i < n; i++ )
+	{
+		qword old = rs.state;
+		rs.state = old * 6364136223846793005ULL + rs.inc;
+		dword xorshifted = (dword)(((old >> 18) ^ old) >> 27);
+		dword rot = (dword)(old >> 59);
+		dword r = (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+		out[i] = from + (r >> 8) * scale;
+	}
+	CORE_RandStreams[stream] = rs;
+}
+
+//=============================================================================
+// GL state cache: the core render functions set texture, blend mode, program
+// etc. through these, and calls that wouldn't change anything are skipped
+// (and counted). Program, VAO & array buffer always start at 0 and only core
+// changes them, so they're never unknown (their entry points may not even
+// exist without GL 3.3).
+
+static const GLuint GL_UNKNOWN = ~0u;
+
+struct CORE_GLStateCache
+{
+	GLuint   tex;				// GL_TEXTURE_2D on unit 0
+	GLuint   blend;				// Source factor << 16 | destination factor
+	GLuint   client_arrays;		// Vertex, texcoord & color arrays enabled (bool)
+	GLuint   program;
+	GLuint   vao;
+	GLuint   array_buffer;
+	CORE_GLStats stats;
+};
+
+CORE_GLStateCache CORE_GL = { GL_UNKNOWN, GL_UNKNOWN, GL_UNKNOWN, 0, 0, 0, {0, 0} };
+
+//-----------------------------------------------------------------------------
+// True if the call is needed, and remembers the new value
+inline bool CORE_GLChange(GLuint &cached, GLuint value)
+{
+	if ( cached == value )
+	{
+		CORE_GL.stats.elided++;
+		return false;
+	}
+	cached = value;
+	CORE_GL.stats.issued++;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+static void CORE_BindTexture(GLuint tex)
+{
+	if ( CORE_GLChange(CORE_GL.tex, tex) )
+		glBindTexture(GL_TEXTURE_2D, tex);
+}
+
+//-----------------------------------------------------------------------------
+static void CORE_BlendFunc(GLenum src, GLenum dst)
+{
+	if ( CORE_GLChange(CORE_GL.blend, src << 16 | dst) )
+		glBlendFunc(src, dst);
+}
+
+//-----------------------------------------------------------------------------
+static void CORE_EnableSpriteArrays()
+{
+	if ( CORE_GLChange(CORE_GL.client_arrays, 1) )
+	{
+		glEnableClientState(GL_VERTEX_ARRAY);
+		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+		glEnableClientState(GL_COLOR_ARRAY);
+	}
+}
+
+//-----------------------------------------------------------------------------
+static void CORE_UseProgram(GLuint program)
+{
+	if ( CORE_GLChange(CORE_GL.program, program) )
+		glUseProgram(program);
+}
+
+//-----------------------------------------------------------------------------
+static void CORE_BindVertexArray(GLuint vao)
+{
+	if ( CORE_GLChange(CORE_GL.vao, vao) )
+		glBindVertexArray(vao);
+}
+
+//-----------------------------------------------------------------------------
+static void CORE_BindArrayBuffer(GLuint buffer)
+{
+	if ( CORE_GLChange(CORE_GL.array_buffer, buffer) )
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+}
+
+//-----------------------------------------------------------------------------
+// A deleted texture unbinds itself
+static void CORE_ForgetTexture(GLuint tex)
+{
+	if ( CORE_GL.tex == tex )
+		CORE_GL.tex = 0;
+}
+
+//-----------------------------------------------------------------------------
+void CORE_InvalidateGLState()
+{
+	CORE_GL.tex = GL_UNKNOWN;
+	CORE_GL.blend = GL_UNKNOWN;
+	CORE_GL.client_arrays = GL_UNKNOWN;
+}
+
+//-----------------------------------------------------------------------------
+CORE_GLStats CORE_TakeGLStats()
+{
+	CORE_GLStats stats = CORE_GL.stats;
+	CORE_GL.stats.issued = 0;
+	CORE_GL.stats.elided = 0;
+	return stats;
+}
 
 //=============================================================================
 // Loading textures (from BMP files)
+//
+// Textures live in the slots of a table that grows as needed, with the free
+// ones in a list. A texture index is a handle: the slot in the low bits and
+// the slot's generation above, which changes when the texture goes, so an
+// index kept past CORE_UnloadBmp() matches nothing. Bitmaps are shared by
+// file name, loading one again only counts another reference.
+
+static const int TEXTURE_SLOT_BITS = 16;
+static const int TEXTURE_MAX_SLOTS = 1 << TEXTURE_SLOT_BITS;
+static const int TEXTURE_MIN_SLOTS = 256;
 
-static const size_t MAX_TEXTURES = 256;
 struct Texture
 {
-	bool used;
-	float w, h;			// In 0..1 terms
-	int pix_w, pix_h;	// In pixels
-	GLuint tex;
-} g_textures[MAX_TEXTURES] = {0};
+	bool used;
+	float u0, v0, u1, v1;	// UV rectangle, in 0..1 terms
+	int pix_w, pix_h;		// In pixels
+	int page;				// Atlas page, -1 if the texture is its own
+	GLuint tex;
+	GLuint fbo;				// Render targets only
+
+	int   generation;		// Handle bits above the slot, 15 of them
+	int   next;				// Next free slot, or next in the name's bucket
+	int   refs;				// Loads sharing it
+	char *name;				// File it came from, NULL for render targets
+	bool  wrap;
+	dword name_hash;
+};
+
+Texture *g_textures = NULL;
+int      g_num_texture_slots = 0;
+int      g_free_texture = -1;		// First free slot, -1 if none
+int     *g_texture_names = NULL;	// Name hash buckets, a slot chain each
+
+//-----------------------------------------------------------------------------
+struct CORE_BMPFileHeader
+{
+	byte  mark[2];
+	byte  filesize[4];
+	byte  reserved[4];
+	byte  pixdataoffset[4];
+
+	byte  hdrsize[4];
+	byte  width[4];
+	byte  height[4];
+	byte  colorplanes[2];
+	byte  bpp[2];
+	byte  compression[4];
+	byte  pixdatasize[4];
+	byte  hres[4];
+	byte  vres[4];
+	byte  numcol[4];
+	byte  numimportantcolors[4];
+};
+
+//-----------------------------------------------------------------------------
+// Utility functions
+template<typename T>
+inline word ReadWord(const T a[])	{ return (a[0] + a[1]*0x100); }
+template<typename T>
+inline dword ReadDWord(const T a[]) { return (a[0] + a[1] * 0x100 + a[2] * 0x10000 + (dword)a[3] * 0x1000000); }
+inline void  WriteWord(byte a[], word v)	{ a[0] = (byte)v; a[1] = (byte)(v >> 8); }
+inline void  WriteDWord(byte a[], dword v)	{ WriteWord(a, (word)v); WriteWord(a + 2, (word)(v >> 16)); }
+
+// FNV-1a, for file names
+static dword CORE_HashName(const char name[])
+{
+	dword h = 2166136261u;
+	for ( ; *name; name++ )
+		h = (h ^ (byte)*name) * 16777619u;
+	return h;
+}
+
+// Next higher power of 2
+dword hp2(dword v)
+{
+	v--;
+	v |= v >> 1;
+	v |= v >> 2;
+	v |= v >> 4;
+	v |= v >> 8;
+	v |= v >> 16;
+	v++; 
+	return v += (v == 0);
+}
+
+// Copies BGRA pixels scaling colour by alpha on the way, for the GL_ONE,
+// GL_ONE_MINUS_SRC_ALPHA blend. The source is usually a file mapping at any
+// alignment, hence bytes.
+static void CORE_PremultiplyCopy(byte dst[], const byte src[], size_t num_pixels)
+{
+	for ( size_t i = 0; i < num_pixels; i++, dst += 4, src += 4 )
+	{
+		unsigned a = src[3];
+		// x * a / 255, rounded
+		for ( int c = 0; c < 3; c++ )
+		{
+			unsigned v = src[c] * a + 128;
+			dst[c] = (byte)((v + (v >> 8)) >> 8);
+		}
+		dst[3] = (byte)a;
+	}
+}
+
+//-----------------------------------------------------------------------------
+static int CORE_TextureHandle(int slot)
+{
+	return slot | g_textures[slot].generation << TEXTURE_SLOT_BITS;
+}
+
+//-----------------------------------------------------------------------------
+// The texture behind a handle to change, NULL if it's stale or no handle at all
+static Texture *CORE_TexSlot(int texture_index)
+{
+	int slot = texture_index & (TEXTURE_MAX_SLOTS - 1);
+	if ( texture_index >= 0 && slot < g_num_texture_slots && g_textures[slot].used
+		&& g_textures[slot].generation == texture_index >> TEXTURE_SLOT_BITS )
+		return &g_textures[slot];
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// The texture behind a handle to read, a blank one if it's stale
+static const Texture &CORE_Tex(int texture_index)
+{
+	static const Texture blank = {};
+	const Texture *t = CORE_TexSlot(texture_index);
+	return t ? *t : blank;
+}
+
+//-----------------------------------------------------------------------------
+// Doubles the table, the new slots going on the free list
+static bool CORE_GrowTextures()
+{
+	int num_slots = g_num_texture_slots ? 2 * g_num_texture_slots : TEXTURE_MIN_SLOTS;
+	if ( num_slots > TEXTURE_MAX_SLOTS )
+		return false;
+	Texture *textures = (Texture *)realloc(g_textures, num_slots * sizeof(Texture));
+	if ( textures )
+		g_textures = textures;
+	int *names = (int *)malloc(num_slots * sizeof(int));
+	if ( !textures || !names )
+	{
+		free(names);
+		return false;
+	}
+
+	memset(textures + g_num_texture_slots, 0, (num_slots - g_num_texture_slots) * sizeof(Texture));
+	for ( int i = num_slots - 1; i >= g_num_texture_slots; i-- )
+	{
+		textures[i].next = g_free_texture;
+		g_free_texture = i;
+	}
+
+	// More buckets, so the names go in again
+	for ( int i = 0; i < num_slots; i++ )
+		names[i] = -1;
+	for ( int i = 0; i < g_num_texture_slots; i++ )
+	{
+		if ( textures[i].used && textures[i].name )
+		{
+			int &bucket = names[textures[i].name_hash & (num_slots - 1)];
+			textures[i].next = bucket;
+			bucket = i;
+		}
+	}
+	free(g_texture_names);
+	g_texture_names = names;
+	g_num_texture_slots = num_slots;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// A free slot, made a blank texture with one reference, known by 'name' if
+// there's one. Returns its handle, -1 if the table is full.
+static int CORE_ReserveTexture(const char name[], bool wrap)
+{
+	if ( g_free_texture == -1 && !CORE_GrowTextures() )
+		return -1;
+
+	int slot = g_free_texture;
+	Texture &t = g_textures[slot];
+	g_free_texture = t.next;
+	int generation = t.generation;
+	memset(&t, 0, sizeof(t));
+	t.generation = generation;
+	t.used = true;
+	t.page = -1;
+	t.refs = 1;
+	t.next = -1;
+	if ( name )
+	{
+		size_t len = strlen(name) + 1;
+		t.name = (char *)malloc(len);
+		if ( t.name )
+		{
+			memcpy(t.name, name, len);
+			t.wrap = wrap;
+			t.name_hash = CORE_HashName(name);
+			int &bucket = g_texture_names[t.name_hash & (g_num_texture_slots - 1)];
+			t.next = bucket;
+			bucket = slot;
+		}
+	}
+	return CORE_TextureHandle(slot);
+}
+
+//-----------------------------------------------------------------------------
+// Back on the free list, with a new generation so its handles go stale
+static void CORE_ReleaseTexture(int texture_index)
+{
+	int slot = texture_index & (TEXTURE_MAX_SLOTS - 1);
+	Texture &t = g_textures[slot];
+	if ( t.name )
+	{
+		int *link = &g_texture_names[t.name_hash & (g_num_texture_slots - 1)];
+		while ( *link != slot )
+			link = &g_textures[*link].next;
+		*link = t.next;
+		free(t.name);
+		t.name = NULL;
+	}
+	t.used = false;
+	t.generation = (t.generation + 1) & 0x7FFF;
+	t.next = g_free_texture;
+	g_free_texture = slot;
+}
+
+//-----------------------------------------------------------------------------
+// A texture loaded from the file already, with one more reference, or -1
+static int CORE_FindTexture(const char name[], bool wrap)
+{
+	if ( !g_num_texture_slots )
+		return -1;
+	dword hash = CORE_HashName(name);
+	for ( int i = g_texture_names[hash & (g_num_texture_slots - 1)]; i != -1; i = g_textures[i].next )
+	{
+		Texture &t = g_textures[i];
+		if ( t.name_hash == hash && t.wrap == wrap && !strcmp(t.name, name) )
+		{
+			t.refs++;
+			return CORE_TextureHandle(i);
+		}
+	}
+	return -1;
+}
+
+//=============================================================================
+// Asset archive: BMPs & WAVs cooked into one file (CORE_CookArchive) that is
+// mapped once. Payloads are ready to upload, premultiplied BGRA rows bottom
+// one first or PCM samples, each on ARCHIVE_ALIGN boundaries. The entries
+// are a hash table on the file name with linear probing, at most half full.
+
+static const dword ARCHIVE_VERSION = 1;
+static const dword ARCHIVE_ALIGN = 4096;
+
+enum { ARCHIVE_FREE, ARCHIVE_BMP, ARCHIVE_WAV };
+
+struct CORE_ArchiveHeader
+{
+	byte  mark[4];			// 'P7AR'
+	byte  version[4];
+	byte  num_slots[4];		// Entries that follow, a power of 2
+	byte  reserved[4];
+};
+
+struct CORE_ArchiveEntry
+{
+	byte  name[64];			// As loaded, '\0' terminated
+	byte  kind[4];			// ARCHIVE_FREE for an empty slot
+	byte  offset[4];		// From the start of the file
+	byte  size[4];
+	byte  width[4];			// WAV: AL format
+	byte  height[4];		// WAV: frequency
+	byte  reserved[12];
+};
+
+struct CORE_ArchiveState
+{
+	const byte              *file;
+	size_t                   file_size;
+	const CORE_ArchiveEntry *entries;
+	dword                    num_slots;
+} CORE_Archive = {};
+
+//-----------------------------------------------------------------------------
+void CORE_CloseArchive()
+{
+	if ( CORE_Archive.file )
+		SYS_UnmapFile(CORE_Archive.file, CORE_Archive.file_size);
+	memset(&CORE_Archive, 0, sizeof(CORE_Archive));
+}
+
+//-----------------------------------------------------------------------------
+bool CORE_OpenArchive(const char filename[])
+{
+	CORE_CloseArchive();
+	size_t file_size = 0;
+	const byte *file = (const byte *)SYS_MapFile(filename, &file_size);
+	if ( !file )
+		return false;
+
+	const CORE_ArchiveHeader &hdr = *(const CORE_ArchiveHeader *)file;
+	dword num_slots = file_size < sizeof(hdr) ? 0 : ReadDWord(hdr.num_slots);
+	bool ok = num_slots && !(num_slots & (num_slots - 1)) && !memcmp(hdr.mark, "P7AR", 4)
+		&& ReadDWord(hdr.version) == ARCHIVE_VERSION
+		&& (file_size - sizeof(hdr)) / sizeof(CORE_ArchiveEntry) >= num_slots;
+
+	// Every payload inside the file & every name terminated, so lookups
+	// needn't check
+	const CORE_ArchiveEntry *entries = (const CORE_ArchiveEntry *)(file + sizeof(hdr));
+	for ( dword i = 0; ok && i < num_slots; i++ )
+	{
+		const CORE_ArchiveEntry &e = entries[i];
+		dword offset = ReadDWord(e.offset), size = ReadDWord(e.size);
+		ok = e.name[sizeof(e.name) - 1] == '\0' && offset <= file_size && size <= file_size - offset
+			&& (ReadDWord(e.kind) != ARCHIVE_BMP || (qword)ReadDWord(e.width) * ReadDWord(e.height) * 4 == size);
+	}
+	if ( !ok )
+	{
+		SYS_UnmapFile(file, file_size);
+		return false;
+	}
+
+	CORE_Archive.file = file;
+	CORE_Archive.file_size = file_size;
+	CORE_Archive.entries = entries;
+	CORE_Archive.num_slots = num_slots;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// The entry for a file, NULL if there's no archive open or it's not in it
+static const CORE_ArchiveEntry *CORE_ArchiveFind(const char name[], dword kind)
+{
+	const CORE_ArchiveState &ar = CORE_Archive;
+	if ( !ar.file )
+		return NULL;
+
+	dword slot = CORE_HashName(name);
+	for ( dword n = 0; n < ar.num_slots; n++, slot++ )
+	{
+		const CORE_ArchiveEntry &e = ar.entries[slot & (ar.num_slots - 1)];
+		dword e_kind = ReadDWord(e.kind);
+		if ( e_kind == ARCHIVE_FREE )
+			break;
+		if ( e_kind == kind && !strcmp((const char *)e.name, name) )
+			return &e;
+	}
+	return NULL;
+}
+
+//=============================================================================
+// CPU copies of the textures for the software renderer to sample. They are
+// only kept while it's on (CORE_InitSoftRender) and are found by GL name, as
+// that's what sprite batches carry.
+
+struct CORE_SoftTexture
+{
+	GLuint tex;
+	dword *pixels;		// BGRA, premultiplied, bottom row first
+	int    w, h;		// Powers of 2, so coordinates wrap with a mask
+};
+
+static const int SOFT_MIN_TEXTURES = 256;
+
+// Each on its own allocation, queued quads point at them while the table grows
+CORE_SoftTexture **CORE_SoftTextures = NULL;
+int                CORE_SoftNumTextures = 0;	// Entries in the table, NULL if free
+bool               CORE_SoftKeepTextures = false;
+
+//-----------------------------------------------------------------------------
+// A free entry in the table, doubling it if there's none. -1 if out of memory.
+static int CORE_SoftFreeTexture()
+{
+	for ( int i = 0; i < CORE_SoftNumTextures; i++ )
+		if ( !CORE_SoftTextures[i] )
+			return i;
+
+	int num = CORE_SoftNumTextures ? 2 * CORE_SoftNumTextures : SOFT_MIN_TEXTURES;
+	CORE_SoftTexture **textures = (CORE_SoftTexture **)realloc(CORE_SoftTextures, num * sizeof(*textures));
+	if ( !textures )
+		return -1;
+	memset(textures + CORE_SoftNumTextures, 0, (num - CORE_SoftNumTextures) * sizeof(*textures));
+	CORE_SoftTextures = textures;
+	int first = CORE_SoftNumTextures;
+	CORE_SoftNumTextures = num;
+	return first;
+}
+
+//-----------------------------------------------------------------------------
+// Copies a width x height image into the bottom left of a tex_w x tex_h one
+static void CORE_SoftAddTexture(GLuint tex, const byte pixels[], int width, int height, int tex_w, int tex_h)
+{
+	int i = CORE_SoftFreeTexture();
+	CORE_SoftTexture *st = i < 0 ? NULL : (CORE_SoftTexture *)malloc(sizeof(CORE_SoftTexture));
+	dword *copy = st ? (dword *)calloc((size_t)tex_w * tex_h, 4) : NULL;
+	if ( !copy )
+	{
+		free(st);
+		SYS_Log("Out of memory for a software renderer texture, it won't be drawn\n");
+		return;
+	}
+	for ( int row = 0; row < height; row++ )
+		memcpy(copy + row * tex_w, pixels + row * width * 4, width * 4);
+	st->tex = tex;
+	st->pixels = copy;
+	st->w = tex_w;
+	st->h = tex_h;
+	CORE_SoftTextures[i] = st;
+}
+
+//-----------------------------------------------------------------------------
+static void CORE_SoftForgetTexture(GLuint tex)
+{
+	for ( int i = 0; i < CORE_SoftNumTextures; i++ )
+	{
+		CORE_SoftTexture *st = CORE_SoftTextures[i];
+		if ( st && st->tex == tex )
+		{
+			free(st->pixels);
+			free(st);
+			CORE_SoftTextures[i] = NULL;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+static const CORE_SoftTexture *CORE_SoftFindTexture(GLuint tex)
+{
+	static int last = 0;	// Batches tend to reuse a few textures
+	if ( last < CORE_SoftNumTextures && CORE_SoftTextures[last] && CORE_SoftTextures[last]->tex == tex )
+		return CORE_SoftTextures[last];
+	for ( int i = 0; i < CORE_SoftNumTextures; i++ )
+		if ( CORE_SoftTextures[i] && CORE_SoftTextures[i]->tex == tex )
+			return CORE_SoftTextures[last = i];
+	return NULL;
+}
+
+//=============================================================================
+// Texture atlas. Between CORE_BeginAtlas() and CORE_EndAtlas(), bitmaps that
+// don't wrap are packed into big shared pages with a skyline packer instead
+// of getting a texture each. Every image is surrounded by a copy of its own
+// edge pixels, so neighbours never bleed in at the borders of a quad. Pages
+// opened by a Begin/End are the size given to Begin, a power of 2.
+
+static const int ATLAS_SIZE = 1024;		// Default page size
+static const int ATLAS_MAX_PAGES = 16;
+static const int ATLAS_MAX_NODES = 256;
+static const int ATLAS_BORDER = 1;
+
+struct CORE_SkylineNode
+{
+	int x, y, w;
+};
+
+struct CORE_AtlasPage
+{
+	byte            *pixels;	// BGRA, bottom row first, only while building
+	CORE_SkylineNode nodes[ATLAS_MAX_NODES];
+	int              num_nodes;
+	int              size;
+	int              refs;		// Textures living in the page
+	GLuint           tex;
+};
+
+CORE_AtlasPage CORE_AtlasPages[ATLAS_MAX_PAGES];
+bool           CORE_AtlasBuilding = false;
+int            CORE_AtlasPageSize = ATLAS_SIZE;	// For pages opened now
+
+//-----------------------------------------------------------------------------
+// Lowest y at which a w x h rectangle fits with its left edge on node i,
+// or -1 if it doesn't fit there at all.
+static int CORE_SkylineFit(const CORE_AtlasPage &page, int i, int w, int h)
+{
+	if ( page.nodes[i].x + w > page.size )
+		return -1;
+
+	int y = 0;
+	for ( int left = w; left > 0; left -= page.nodes[i++].w )
+	{
+		if ( page.nodes[i].y > y )
+			y = page.nodes[i].y;
+		if ( y + h > page.size )
+			return -1;
+	}
+	return y;
+}
+
+//-----------------------------------------------------------------------------
+// Bottom-left skyline allocation: lowest top edge wins, narrowest node breaks ties
+static bool CORE_SkylineAlloc(CORE_AtlasPage &page, int w, int h, int &out_x, int &out_y)
+{
+	int best = -1, best_top = page.size + 1, best_w = page.size + 1;
+	for ( int i = 0; i < page.num_nodes; i++ )
+	{
+		int y = CORE_SkylineFit(page, i, w, h);
+		if ( y < 0 )
+			continue;
+		if ( y + h < best_top || (y + h == best_top && page.nodes[i].w < best_w) )
+		{
+			best = i;
+			best_top = y + h;
+			best_w = page.nodes[i].w;
+			out_x = page.nodes[i].x;
+			out_y = y;
+		}
+	}
+	if ( best < 0 || page.num_nodes == ATLAS_MAX_NODES )
+		return false;
+
+	// New node on top of the rectangle...
+	CORE_SkylineNode *nodes = page.nodes;
+	memmove(&nodes[best + 1], &nodes[best], (page.num_nodes - best) * sizeof(nodes[0]));
+	page.num_nodes++;
+	nodes[best].x = out_x;
+	nodes[best].y = best_top;
+	nodes[best].w = w;
+
+	// ...shadowing the ones it now covers...
+	for ( int i = best + 1; i < page.num_nodes; )
+	{
+		int covered = nodes[i - 1].x + nodes[i - 1].w - nodes[i].x;
+		if ( covered <= 0 )
+			break;
+		nodes[i].x += covered;
+		nodes[i].w -= covered;
+		if ( nodes[i].w > 0 )
+			break;
+		memmove(&nodes[i], &nodes[i + 1], (page.num_nodes - i - 1) * sizeof(nodes[0]));
+		page.num_nodes--;
+	}
+
+	// ...and merged with neighbours at the same height
+	for ( int i = 0; i + 1 < page.num_nodes; )
+	{
+		if ( nodes[i].y == nodes[i + 1].y )
+		{
+			nodes[i].w += nodes[i + 1].w;
+			memmove(&nodes[i + 1], &nodes[i + 2], (page.num_nodes - i - 2) * sizeof(nodes[0]));
+			page.num_nodes--;
+		}
+		else
+			i++;
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Copies a width x height image into the page at (x, y), border included,
+// premultiplying it unless it is already. Row i starts at pixels + i * stride.
+static void CORE_AtlasBlit(CORE_AtlasPage &page, int x, int y, const byte pixels[], ptrdiff_t stride,
+	int width, int height, bool premultiplied)
+{
+	for ( int row = -ATLAS_BORDER; row < height + ATLAS_BORDER; row++ )
+	{
+		int src_row = row < 0 ? 0 : row >= height ? height - 1 : row;
+		dword *dst = (dword *)page.pixels + (y + ATLAS_BORDER + row) * page.size + x + ATLAS_BORDER;
+
+		if ( premultiplied )
+			memcpy(dst, pixels + src_row * stride, width * 4);
+		else
+			CORE_PremultiplyCopy((byte *)dst, pixels + src_row * stride, width);
+		for ( int i = 1; i <= ATLAS_BORDER; i++ )
+		{
+			dst[-i] = dst[0];
+			dst[width - 1 + i] = dst[width - 1];
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Packs a loaded image into the first page with room, opening pages as needed
+static bool CORE_AtlasAdd(Texture &t, const byte pixels[], ptrdiff_t stride, int width, int height,
+	bool premultiplied)
+{
+	int w = width + 2 * ATLAS_BORDER;
+	int h = height + 2 * ATLAS_BORDER;
+	if ( w > CORE_AtlasPageSize || h > CORE_AtlasPageSize )
+		return false;
+
+	for ( int p = 0; p < ATLAS_MAX_PAGES; p++ )
+	{
+		CORE_AtlasPage &page = CORE_AtlasPages[p];
+		if ( !page.pixels )
+		{
+			if ( page.refs )
+				continue;	// Built already, and in use
+			page.pixels = (byte *)calloc((size_t)CORE_AtlasPageSize * CORE_AtlasPageSize, 4);
+			if ( !page.pixels )
+				return false;
+			page.size = CORE_AtlasPageSize;
+			page.num_nodes = 1;
+			page.nodes[0].x = 0;
+			page.nodes[0].y = 0;
+			page.nodes[0].w = page.size;
+		}
+
+		int x = 0, y = 0;
+		if ( !CORE_SkylineAlloc(page, w, h, x, y) )
+			continue;
+		CORE_AtlasBlit(page, x, y, pixels, stride, width, height, premultiplied);
+
+		t.page = p;
+		t.tex = 0;	// Page texture, once CORE_EndAtlas() uploads it
+		t.u0 = (x + ATLAS_BORDER) / (float)page.size;
+		t.v0 = (y + ATLAS_BORDER) / (float)page.size;
+		t.u1 = (x + ATLAS_BORDER + width) / (float)page.size;
+		t.v1 = (y + ATLAS_BORDER + height) / (float)page.size;
+		page.refs++;
+		return true;
+	}
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+void CORE_BeginAtlas(int page_size)
+{
+	CORE_AtlasBuilding = true;
+	CORE_AtlasPageSize = page_size > 0 ? (int)hp2(page_size) : ATLAS_SIZE;
+}
+
+//-----------------------------------------------------------------------------
+int CORE_EndAtlas()
+{
+	int num_pages = 0;
+	for ( int p = 0; p < ATLAS_MAX_PAGES; p++ )
+	{
+		CORE_AtlasPage &page = CORE_AtlasPages[p];
+		if ( !page.pixels )
+			continue;
+
+		if ( page.refs )
+		{
+			glGenTextures(1, &page.tex);
+			CORE_BindTexture(page.tex);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, page.size, page.size, 0, GL_BGRA_EXT, GL_UNSIGNED_BYTE, page.pixels);
+			if ( CORE_SoftKeepTextures )
+				CORE_SoftAddTexture(page.tex, page.pixels, page.size, page.size, page.size, page.size);
+
+			for ( int i = 0; i < g_num_texture_slots; i++ )
+				if ( g_textures[i].used && g_textures[i].page == p )
+					g_textures[i].tex = page.tex;
+			num_pages++;
+		}
+		free(page.pixels);
+		page.pixels = NULL;
+	}
+	CORE_AtlasBuilding = false;
+	return num_pages;
+}
+
+//-----------------------------------------------------------------------------
+// A decoded bitmap: BGRA rows, bottom one first, row i at pixels + i * stride
+struct CORE_BmpImage
+{
+	const byte *pixels;
+	ptrdiff_t   stride;
+	int         width, height;
+	bool        premultiplied;
+};
+
+//-----------------------------------------------------------------------------
+// Finds the pixels of a BMP file in memory, false if it's not one we can use
+static bool CORE_ParseBmp(const byte file[], size_t file_size, CORE_BmpImage &img)
+{
+	const CORE_BMPFileHeader &hdr = *(const CORE_BMPFileHeader *)file;
+	if ( file_size < sizeof(hdr) || hdr.mark[0] != 'B' || hdr.mark[1] != 'M' )
+		return false;
+
+	dword  width = ReadDWord(hdr.width);
+	sdword height = ReadDWord(hdr.height);
+	dword  offset = ReadDWord(hdr.pixdataoffset);
+	int    rows = abs((int)height);
+
+	// 32 bpp only, and every row inside the file
+	if ( ReadWord(hdr.bpp) != 32 || !width || !rows || offset > file_size
+		|| (file_size - offset) / 4 / width < (dword)rows )
+		return false;
+
+	// GL wants the bottom row first, like bottom-up files (positive height)
+	// have it. Top-down ones are walked from their last row up instead.
+	img.pixels = file + offset;
+	img.stride = (ptrdiff_t)width * 4;
+	img.width = width;
+	img.height = rows;
+	img.premultiplied = false;
+	if ( height < 0 )
+	{
+		img.pixels += (rows - 1) * img.stride;
+		img.stride = -img.stride;
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Puts an image in a reserved texture entry: the open atlas if it can, else
+// a texture of its own. False if there's no memory to stage it, the entry
+// is left blank then.
+static bool CORE_UploadBmp(int texture_index, const CORE_BmpImage &img, bool wrap)
+{
+	Texture *slot = CORE_TexSlot(texture_index);
+	if ( !slot )
+		return false;
+	Texture &t = *slot;
+	if ( CORE_AtlasBuilding && !wrap
+		&& CORE_AtlasAdd(t, img.pixels, img.stride, img.width, img.height, img.premultiplied) )
+	{
+		t.pix_w = img.width;
+		t.pix_h = img.height;
+		return true;
+	}
+
+	// GL needs premultiplied, tightly packed rows: a buffer just the image's
+	// size unless they're that already
+	const byte *pixels = img.pixels;
+	byte *buffer = NULL;
+	if ( !img.premultiplied || img.stride != img.width * 4 )
+	{
+		buffer = (byte *)malloc((size_t)img.width * img.height * 4);
+		for ( int row = 0; buffer && row < img.height; row++ )
+		{
+			if ( img.premultiplied )
+				memcpy(buffer + row * img.width * 4, img.pixels + row * img.stride, img.width * 4);
+			else
+				CORE_PremultiplyCopy(buffer + row * img.width * 4, img.pixels + row * img.stride, img.width);
+		}
+		if ( !buffer )
+			return false;
+		pixels = buffer;
+	}
+
+	GLuint texid = 1;
+
+	glGenTextures(1, &texid);
+	CORE_BindTexture(texid);
+	//glTexEnvf( GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE );
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST); // GL_LINEAR_MIPMAP_NEAREST
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST); // GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap ? GL_REPEAT : GL_CLAMP);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrap ? GL_REPEAT : GL_CLAMP);
+
+	//gluBuild2DMipmaps( GL_TEXTURE_2D, GL_RGBA8, width, height, GL_BGRA_EXT, GL_UNSIGNED_BYTE, pixels );
+
+	dword width_pow2 = hp2(img.width);
+	dword height_pow2 = hp2(img.height);
+
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width_pow2, height_pow2, 0, GL_BGRA_EXT, GL_UNSIGNED_BYTE, NULL);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, img.width, img.height, GL_BGRA_EXT, GL_UNSIGNED_BYTE, pixels);
+	if ( CORE_SoftKeepTextures )
+		CORE_SoftAddTexture(texid, pixels, img.width, img.height, width_pow2, height_pow2);
+	free(buffer);
+
+	t.pix_w = img.width;
+	t.pix_h = img.height;
+	t.page = -1;
+	t.tex = texid;
+	t.u0 = 0.f;
+	t.v0 = 0.f;
+	t.u1 = img.width / (float)width_pow2;
+	t.v1 = img.height / (float)height_pow2;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Core functions
+int CORE_LoadBmp(const char filename[], bool wrap, bool shared)
+{
+	GLint	retval = shared ? CORE_FindTexture(filename, wrap) : -1;
+	size_t	file_size = 0;
+	if ( retval != -1 )
+		return retval;
+
+	// Unshared ones go without a name, so nothing finds them
+	const char *name = shared ? filename : NULL;
+
+	// Cooked ones are uploaded as they are
+	const CORE_ArchiveEntry *cooked = CORE_ArchiveFind(filename, ARCHIVE_BMP);
+	if ( cooked )
+	{
+		CORE_BmpImage img;
+		img.pixels = CORE_Archive.file + ReadDWord(cooked->offset);
+		img.width = ReadDWord(cooked->width);
+		img.height = ReadDWord(cooked->height);
+		img.stride = img.width * 4;
+		img.premultiplied = true;
+		if ( (retval = CORE_ReserveTexture(name, wrap)) != -1 && !CORE_UploadBmp(retval, img, wrap) )
+		{
+			CORE_ReleaseTexture(retval);
+			retval = -1;
+		}
+		return retval;
+	}
+
+	// Pixels are read straight from the file mapping, no staging copy
+	const byte *file = (const byte *)SYS_MapFile(filename, &file_size);
+	if ( !file )
+		return retval;
+
+	CORE_BmpImage img;
+	if ( CORE_ParseBmp(file, file_size, img) && (retval = CORE_ReserveTexture(name, wrap)) != -1
+		&& !CORE_UploadBmp(retval, img, wrap) )
+	{
+		CORE_ReleaseTexture(retval);
+		retval = -1;
+	}
+	SYS_UnmapFile(file, file_size);
+
+	return retval;
+}
+//-----------------------------------------------------------------------------
+void CORE_UnloadBmp(int texture_index)
+{
+	// Stale, or still shared
+	Texture *slot = CORE_TexSlot(texture_index);
+	if ( !slot || --slot->refs > 0 )
+		return;
+	Texture &t = *slot;
+
+	if ( t.fbo )
+		glDeleteFramebuffers(1, &t.fbo);
+	t.fbo = 0;
+	if ( t.page < 0 )
+	{
+		CORE_ForgetTexture(t.tex);
+		CORE_SoftForgetTexture(t.tex);
+		glDeleteTextures(1, &t.tex);
+	}
+	else
+	{
+		// The page goes when its last texture does
+		CORE_AtlasPage &page = CORE_AtlasPages[t.page];
+		if ( !--page.refs && page.tex )
+		{
+			CORE_ForgetTexture(page.tex);
+			CORE_SoftForgetTexture(page.tex);
+			glDeleteTextures(1, &page.tex);
+			page.tex = 0;
+		}
+	}
+	CORE_ReleaseTexture(texture_index);
+}
+
+//-----------------------------------------------------------------------------
+ivec2 CORE_GetBmpSize(int texture_index)
+{
+	ivec2 v;
+	v.x = CORE_Tex(texture_index).pix_w;
+	v.y = CORE_Tex(texture_index).pix_h;
+	return v;
+}
+
+//-----------------------------------------------------------------------------
+GLuint CORE_GetBmpOpenGLTex(int texture_index)
+{
+	return CORE_Tex(texture_index).tex;
+}
+
+//=============================================================================
+// Sprite batch: quads pile up in a client-side array for as long as the
+// texture stays the same, then go out in a single draw call. The legacy path
+// expands them to GL_QUADS vertices; the GL 3.3 one (CORE_InitInstancing)
+// streams them as-is into an instance buffer, one instance per quad.
+//
+// Textures are premultiplied on load and everything is drawn with one blend
+// mode, GL_ONE, GL_ONE_MINUS_SRC_ALPHA. Quad colours are premultiplied too,
+// and additive quads simply get alpha 0: nothing of the background is taken
+// away, so their colour adds up. Alpha & additive quads share batches.
+
+static const size_t BATCH_MAX_QUADS = 16384;
+
+struct CORE_SpriteQuad
+{
+	float x0, y0, x1, y1;
+	float u0, v0, u1, v1;
+	byte  r, g, b, a;		// Premultiplied, a = 0 for additive
+};
+
+struct CORE_SpriteVertex
+{
+	float x, y;
+	float u, v;
+	byte  r, g, b, a;
+};
+
+CORE_SpriteQuad   CORE_BatchQuads[BATCH_MAX_QUADS];
+size_t            CORE_BatchCount = 0;
+GLuint            CORE_BatchTex = 0;
+CORE_SpriteVertex CORE_BatchVerts[BATCH_MAX_QUADS * 4];
+
+//-----------------------------------------------------------------------------
+// GL 3.3 instanced pipeline
+
+struct CORE_InstancedState
+{
+	bool   active;
+	GLuint program;
+	GLuint vao;
+	GLuint corner_vbo;		// The unit quad, as a triangle strip
+	GLuint instance_vbo;
+	GLint  view_loc;
+};
+
+CORE_InstancedState CORE_Instanced = {};
+
+// Game units to clip space (scale x, y & offset x, y) for the shader paths,
+// kept in step with the fixed-function projection by CORE_SetView()
+float CORE_View[4] = { 1.f, 1.f, 0.f, 0.f };
+
+static const char *CORE_SPRITE_VS =
+	"#version 330 core\n"
+	"layout(location = 0) in vec2 corner;\n"
+	"layout(location = 1) in vec4 rect;\n"
+	"layout(location = 2) in vec4 uvrect;\n"
+	"layout(location = 3) in vec4 color;\n"
+	"uniform vec4 view;\n"
+	"out vec2 uv;\n"
+	"out vec4 tint;\n"
+	"void main()\n"
+	"{\n"
+	"	uv = mix(uvrect.xy, uvrect.zw, corner);\n"
+	"	tint = color;\n"
+	"	gl_Position = vec4(mix(rect.xy, rect.zw, corner) * view.xy + view.zw, 0.0, 1.0);\n"
+	"}\n";
+
+static const char *CORE_SPRITE_FS =
+	"#version 330 core\n"
+	"uniform sampler2D tex;\n"
+	"in vec2 uv;\n"
+	"in vec4 tint;\n"
+	"out vec4 frag;\n"
+	"void main()\n"
+	"{\n"
+	"	frag = texture(tex, uv) * tint;\n"
+	"}\n";
+
+//-----------------------------------------------------------------------------
+static GLuint CORE_CompileShader(GLenum type, const char source[])
+{
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
+
+	GLint ok = 0;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+	if ( !ok )
+	{
+		glDeleteShader(shader);
+		return 0;
+	}
+	return shader;
+}
+
+//-----------------------------------------------------------------------------
+bool CORE_InitInstancing()
+{
+	CORE_InstancedState &is = CORE_Instanced;
+	if ( is.active )
+		return true;
+
+	GLuint vs = CORE_CompileShader(GL_VERTEX_SHADER, CORE_SPRITE_VS);
+	GLuint fs = CORE_CompileShader(GL_FRAGMENT_SHADER, CORE_SPRITE_FS);
+	if ( !vs || !fs )
+	{
+		if ( vs ) glDeleteShader(vs);
+		if ( fs ) glDeleteShader(fs);
+		return false;
+	}
+
+	is.program = glCreateProgram();
+	glAttachShader(is.program, vs);
+	glAttachShader(is.program, fs);
+	glLinkProgram(is.program);
+	glDeleteShader(vs);
+	glDeleteShader(fs);
+
+	GLint ok = 0;
+	glGetProgramiv(is.program, GL_LINK_STATUS, &ok);
+	if ( !ok )
+	{
+		glDeleteProgram(is.program);
+		is.program = 0;
+		return false;
+	}
+
+	is.view_loc = glGetUniformLocation(is.program, "view");
+	CORE_UseProgram(is.program);
+	glUniform1i(glGetUniformLocation(is.program, "tex"), 0);
+
+	static const float corners[] = { 0.f, 0.f, 1.f, 0.f, 0.f, 1.f, 1.f, 1.f };
+
+	glGenVertexArrays(1, &is.vao);
+	CORE_BindVertexArray(is.vao);
+
+	glGenBuffers(1, &is.corner_vbo);
+	CORE_BindArrayBuffer(is.corner_vbo);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, false, 2 * sizeof(float), (const void *)0);
+
+	glGenBuffers(1, &is.instance_vbo);
+	CORE_BindArrayBuffer(is.instance_vbo);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(CORE_BatchQuads), NULL, GL_STREAM_DRAW);
+
+	const GLsizei stride = sizeof(CORE_SpriteQuad);
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(1, 4, GL_FLOAT, false, stride, (const void *)offsetof(CORE_SpriteQuad, x0));
+	glEnableVertexAttribArray(2);
+	glVertexAttribPointer(2, 4, GL_FLOAT, false, stride, (const void *)offsetof(CORE_SpriteQuad, u0));
+	glEnableVertexAttribArray(3);
+	glVertexAttribPointer(3, 4, GL_UNSIGNED_BYTE, true, stride, (const void *)offsetof(CORE_SpriteQuad, r));
+	for ( GLuint i = 1; i <= 3; i++ )
+		glVertexAttribDivisor(i, 1);
+
+	CORE_FlushSprites();
+	is.active = true;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+void CORE_EndInstancing()
+{
+	CORE_InstancedState &is = CORE_Instanced;
+	if ( !is.active )
+		return;
+
+	CORE_FlushSprites();
+	CORE_UseProgram(0);
+	CORE_BindVertexArray(0);
+	CORE_BindArrayBuffer(0);
+	glDeleteBuffers(1, &is.instance_vbo);
+	glDeleteBuffers(1, &is.corner_vbo);
+	glDeleteVertexArrays(1, &is.vao);
+	glDeleteProgram(is.program);
+	memset(&is, 0, sizeof(is));
+}
+
+//-----------------------------------------------------------------------------
+bool CORE_IsInstancing()
+{
+	return CORE_Instanced.active;
+}
+
+//-----------------------------------------------------------------------------
+static void CORE_FlushInstanced()
+{
+	const CORE_InstancedState &is = CORE_Instanced;
+
+	CORE_BlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	CORE_BindTexture(CORE_BatchTex);
+	CORE_UseProgram(is.program);
+	glUniform4f(is.view_loc, CORE_View[0], CORE_View[1], CORE_View[2], CORE_View[3]);
+	CORE_BindVertexArray(is.vao);
+
+	// Orphan the buffer, so the driver needn't wait for the previous draw
+	CORE_BindArrayBuffer(is.instance_vbo);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(CORE_BatchQuads), NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, CORE_BatchCount * sizeof(CORE_SpriteQuad), CORE_BatchQuads);
+	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, (GLsizei)CORE_BatchCount);
+}
+
+//-----------------------------------------------------------------------------
+static void CORE_FlushLegacy()
+{
+	for ( size_t i = 0; i < CORE_BatchCount; i++ )
+	{
+		const CORE_SpriteQuad &q = CORE_BatchQuads[i];
+		CORE_SpriteVertex *v = &CORE_BatchVerts[i * 4];
+		v[0].x = q.x0; v[0].y = q.y0; v[0].u = q.u0; v[0].v = q.v0;
+		v[1].x = q.x1; v[1].y = q.y0; v[1].u = q.u1; v[1].v = q.v0;
+		v[2].x = q.x1; v[2].y = q.y1; v[2].u = q.u1; v[2].v = q.v1;
+		v[3].x = q.x0; v[3].y = q.y1; v[3].u = q.u0; v[3].v = q.v1;
+		for ( int j = 0; j < 4; j++ )
+		{
+			v[j].r = q.r; v[j].g = q.g; v[j].b = q.b; v[j].a = q.a;
+		}
+	}
+
+	CORE_BlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	CORE_BindTexture(CORE_BatchTex);
+
+	// Fixed function, with client-side arrays
+	CORE_UseProgram(0);
+	CORE_BindVertexArray(0);
+	CORE_BindArrayBuffer(0);
+	CORE_EnableSpriteArrays();
+	glVertexPointer(2, GL_FLOAT, sizeof(CORE_SpriteVertex), &CORE_BatchVerts[0].x);
+	glTexCoordPointer(2, GL_FLOAT, sizeof(CORE_SpriteVertex), &CORE_BatchVerts[0].u);
+	glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(CORE_SpriteVertex), &CORE_BatchVerts[0].r);
+	glDrawArrays(GL_QUADS, 0, (GLsizei)(CORE_BatchCount * 4));
+}
+
+//=============================================================================
+// Software renderer: with it on, sprite batches are rasterised on the CPU
+// instead of going to GL. Flushed quads are converted to pixels and binned
+// into SOFT_TILE square screen tiles, and nothing is drawn until the frame is
+// presented (or the quad list fills up). Then every thread grabs tiles off a
+// shared counter and draws each tile's quads in submission order, so tiles
+// never share pixels and the blending order is the same as GL's.
+//
+// Sprites are axis aligned and sampled nearest, so a quad is just a rect of
+// pixels with texel coords stepping linearly along x & y (16.16 fixed point).
+// Blending is GL_ONE, GL_ONE_MINUS_SRC_ALPHA on premultiplied colours like the
+// GL paths, which covers additive quads too (alpha 0), 4 pixels at a time.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CORE_SOFT_SSE2
+#include <emmintrin.h>
+#endif
+
+static const int    SOFT_TILE = 64;
+static const size_t SOFT_MAX_QUADS = 65536;
+static const int    SOFT_MAX_THREADS = 16;
+
+struct CORE_SoftQuad
+{
+	int   x0, y0, x1, y1;		// Pixels whose centres are covered, x1 & y1 excluded
+	int   s0, t0, ds, dt;		// Texel coords at pixel (x0, y0) & steps, 16.16
+	dword color;				// BGRA, premultiplied
+	const CORE_SoftTexture *tex;
+};
+
+struct CORE_SoftBin
+{
+	unsigned *quads;			// Indices into CORE_Soft.quads
+	size_t    count, capacity;
+};
+
+struct CORE_SoftState
+{
+	bool           active;
+	int            pix_w, pix_h;
+	int            tiles_x, tiles_y;
+	dword         *frame;		// BGRA, bottom row first
+	CORE_SoftQuad *quads;
+	size_t         num_quads;
+	CORE_SoftBin  *bins;
+	bool           clear;		// Tiles start with clear_color this time
+	dword          clear_color;
+	GLuint         present_tex;
+
+	// Worker threads, each frame is a 'job' they wait for
+	int            num_workers;
+	unsigned       job;
+	int            tiles_left;
+	bool           quit;
+} CORE_Soft = {};
+
+std::thread             CORE_SoftWorkers[SOFT_MAX_THREADS];
+std::mutex              CORE_SoftMutex;
+std::condition_variable CORE_SoftWake, CORE_SoftDone;
+std::atomic<int>        CORE_SoftNextTile(0);
+
+//-----------------------------------------------------------------------------
+inline dword CORE_SoftMul255(dword a, dword b)
+{
+	dword v = a * b + 128;
+	return (v + (v >> 8)) >> 8;
+}
+
+// One pixel, texel * tint blended over dst
+inline dword CORE_SoftBlend(dword texel, dword dst, dword tint)
+{
+	dword src[4], out = 0;
+	for ( int c = 0; c < 4; c++ )
+		src[c] = CORE_SoftMul255((texel >> (c * 8)) & 0xFF, (tint >> (c * 8)) & 0xFF);
+	for ( int c = 0; c < 4; c++ )
+	{
+		dword v = src[c] + CORE_SoftMul255((dst >> (c * 8)) & 0xFF, 255 - src[3]);
+		out |= (v > 255 ? 255 : v) << (c * 8);
+	}
+	return out;
+}
+
+#ifdef CORE_SOFT_SSE2
+// x * y / 255 for 16 bit lanes holding 0..255
+inline __m128i CORE_SoftMul255x8(__m128i x, __m128i y)
+{
+	__m128i v = _mm_add_epi16(_mm_mullo_epi16(x, y), _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(v, _mm_srli_epi16(v, 8)), 8);
+}
+
+// Two pixels unpacked to 16 bit lanes, B G R A each
+inline __m128i CORE_SoftBlendx2(__m128i texels, __m128i dst, __m128i tint)
+{
+	__m128i src = CORE_SoftMul255x8(texels, tint);
+	__m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(src, 0xFF), 0xFF);
+	return _mm_add_epi16(src, CORE_SoftMul255x8(dst, _mm_sub_epi16(_mm_set1_epi16(255), alpha)));
+}
+#endif
+
+//-----------------------------------------------------------------------------
+// Draws the part of a quad inside the x0..x1, y0..y1 pixel rect
+static void CORE_SoftDrawQuad(const CORE_SoftQuad &q, int x0, int y0, int x1, int y1)
+{
+	if ( q.x0 > x0 ) x0 = q.x0;
+	if ( q.y0 > y0 ) y0 = q.y0;
+	if ( q.x1 < x1 ) x1 = q.x1;
+	if ( q.y1 < y1 ) y1 = q.y1;
+	if ( x0 >= x1 || y0 >= y1 )
+		return;
+
+	const CORE_SoftTexture &tex = *q.tex;
+	int w_mask = tex.w - 1, h_mask = tex.h - 1;
+	int s_start = q.s0 + (x0 - q.x0) * q.ds;
+	int t = q.t0 + (y0 - q.y0) * q.dt;
+#ifdef CORE_SOFT_SSE2
+	__m128i zero = _mm_setzero_si128();
+	__m128i tint = _mm_unpacklo_epi8(_mm_set1_epi32((int)q.color), zero);
+#endif
+
+	for ( int y = y0; y < y1; y++, t += q.dt )
+	{
+		const dword *texels = tex.pixels + ((t >> 16) & h_mask) * tex.w;
+		dword *dst = CORE_Soft.frame + y * CORE_Soft.pix_w + x0;
+		int s = s_start, n = x1 - x0;
+#ifdef CORE_SOFT_SSE2
+		for ( ; n >= 4; n -= 4, dst += 4, s += 4 * q.ds )
+		{
+			__m128i src = _mm_setr_epi32((int)texels[(s >> 16) & w_mask], (int)texels[((s + q.ds) >> 16) & w_mask],
+				(int)texels[((s + 2 * q.ds) >> 16) & w_mask], (int)texels[((s + 3 * q.ds) >> 16) & w_mask]);
+			__m128i d = _mm_loadu_si128((const __m128i *)dst);
+			__m128i lo = CORE_SoftBlendx2(_mm_unpacklo_epi8(src, zero), _mm_unpacklo_epi8(d, zero), tint);
+			__m128i hi = CORE_SoftBlendx2(_mm_unpackhi_epi8(src, zero), _mm_unpackhi_epi8(d, zero), tint);
+			_mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(lo, hi));
+		}
+#endif
+		for ( ; n > 0; n--, dst++, s += q.ds )
+			*dst = CORE_SoftBlend(texels[(s >> 16) & w_mask], *dst, q.color);
+	}
+}
+
+//-----------------------------------------------------------------------------
+static void CORE_SoftDrawTile(int tile)
+{
+	const CORE_SoftState &ss = CORE_Soft;
+	int x0 = (tile % ss.tiles_x) * SOFT_TILE;
+	int y0 = (tile / ss.tiles_x) * SOFT_TILE;
+	int x1 = x0 + SOFT_TILE < ss.pix_w ? x0 + SOFT_TILE : ss.pix_w;
+	int y1 = y0 + SOFT_TILE < ss.pix_h ? y0 + SOFT_TILE : ss.pix_h;
+
+	if ( ss.clear )
+		for ( int y = y0; y < y1; y++ )
+			for ( int x = x0; x < x1; x++ )
+				ss.frame[y * ss.pix_w + x] = ss.clear_color;
+
+	const CORE_SoftBin &bin = ss.bins[tile];
+	for ( size_t i = 0; i < bin.count; i++ )
+		CORE_SoftDrawQuad(ss.quads[bin.quads[i]], x0, y0, x1, y1);
+}
+
+//-----------------------------------------------------------------------------
+// Takes tiles of the current job until there are none left
+static void CORE_SoftDrawTiles()
+{
+	int num_tiles = CORE_Soft.tiles_x * CORE_Soft.tiles_y;
+	int drawn = 0;
+	for ( int tile; (tile = CORE_SoftNextTile.fetch_add(1)) < num_tiles; drawn++ )
+		CORE_SoftDrawTile(tile);
+
+	if ( drawn )
+	{
+		std::lock_guard<std::mutex> lock(CORE_SoftMutex);
+		CORE_Soft.tiles_left -= drawn;
+		if ( !CORE_Soft.tiles_left )
+			CORE_SoftDone.notify_all();
+	}
+}
+
+//-----------------------------------------------------------------------------
+static void CORE_SoftWorker()
+{
+	unsigned job = 0;
+	for ( ;; )
+	{
+		{
+			std::unique_lock<std::mutex> lock(CORE_SoftMutex);
+			while ( !CORE_Soft.quit && CORE_Soft.job == job )
+				CORE_SoftWake.wait(lock);
+			if ( CORE_Soft.quit )
+				return;
+			job = CORE_Soft.job;
+		}
+		CORE_SoftDrawTiles();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Draws everything binned so far into the framebuffer, with all threads
+static void CORE_SoftRasterize()
+{
+	CORE_SoftState &ss = CORE_Soft;
+	if ( !ss.num_quads && !ss.clear )
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(CORE_SoftMutex);
+		ss.tiles_left = ss.tiles_x * ss.tiles_y;
+		CORE_SoftNextTile.store(0);
+		ss.job++;
+	}
+	CORE_SoftWake.notify_all();
+	CORE_SoftDrawTiles();
+	{
+		std::unique_lock<std::mutex> lock(CORE_SoftMutex);
+		while ( ss.tiles_left )
+			CORE_SoftDone.wait(lock);
+	}
+
+	for ( int i = 0; i < ss.tiles_x * ss.tiles_y; i++ )
+		ss.bins[i].count = 0;
+	ss.num_quads = 0;
+	ss.clear = false;
+}
+
+//-----------------------------------------------------------------------------
+inline int CORE_SoftFixed(float f)
+{
+	return (int)floorf(f * 65536.f + .5f);
+}
+
+//-----------------------------------------------------------------------------
+// Converts the batch to pixels and bins it
+static void CORE_FlushSoft()
+{
+	CORE_SoftState &ss = CORE_Soft;
+	const CORE_SoftTexture *tex = CORE_SoftFindTexture(CORE_BatchTex);
+	if ( !tex )
+		return;	// Render targets etc. only exist on the GPU
+
+	// View to pixels, see CORE_SetView
+	float sx = .5f * ss.pix_w * CORE_View[0], ox = .5f * ss.pix_w * (CORE_View[2] + 1.f);
+	float sy = .5f * ss.pix_h * CORE_View[1], oy = .5f * ss.pix_h * (CORE_View[3] + 1.f);
+
+	for ( size_t i = 0; i < CORE_BatchCount; i++ )
+	{
+		const CORE_SpriteQuad &sq = CORE_BatchQuads[i];
+		float px0 = sq.x0 * sx + ox, px1 = sq.x1 * sx + ox;
+		float py0 = sq.y0 * sy + oy, py1 = sq.y1 * sy + oy;
+		if ( px0 == px1 || py0 == py1 )
+			continue;
+
+		// Pixel centres inside, clipped to the framebuffer
+		CORE_SoftQuad q;
+		q.x0 = (int)ceilf((px0 < px1 ? px0 : px1) - .5f);
+		q.x1 = (int)ceilf((px0 < px1 ? px1 : px0) - .5f);
+		q.y0 = (int)ceilf((py0 < py1 ? py0 : py1) - .5f);
+		q.y1 = (int)ceilf((py0 < py1 ? py1 : py0) - .5f);
+		if ( q.x0 < 0 ) q.x0 = 0;
+		if ( q.y0 < 0 ) q.y0 = 0;
+		if ( q.x1 > ss.pix_w ) q.x1 = ss.pix_w;
+		if ( q.y1 > ss.pix_h ) q.y1 = ss.pix_h;
+		if ( q.x0 >= q.x1 || q.y0 >= q.y1 )
+			continue;
+
+		// Texel coords at the first pixel centre, brought into the first
+		// repeat of the texture so the fixed point can't overflow
+		float ds = (sq.u1 - sq.u0) * tex->w / (px1 - px0);
+		float dt = (sq.v1 - sq.v0) * tex->h / (py1 - py0);
+		float s0 = sq.u0 * tex->w + (q.x0 + .5f - px0) * ds;
+		float t0 = sq.v0 * tex->h + (q.y0 + .5f - py0) * dt;
+		s0 -= floorf(s0 / tex->w) * tex->w;
+		t0 -= floorf(t0 / tex->h) * tex->h;
+		q.s0 = CORE_SoftFixed(s0);
+		q.t0 = CORE_SoftFixed(t0);
+		q.ds = CORE_SoftFixed(ds);
+		q.dt = CORE_SoftFixed(dt);
+		q.color = sq.b | sq.g << 8 | sq.r << 16 | (dword)sq.a << 24;
+		q.tex = tex;
+
+		if ( ss.num_quads == SOFT_MAX_QUADS )
+			CORE_SoftRasterize();
+		unsigned index = (unsigned)ss.num_quads++;
+		ss.quads[index] = q;
+
+		for ( int ty = q.y0 / SOFT_TILE; ty <= (q.y1 - 1) / SOFT_TILE; ty++ )
+		{
+			for ( int tx = q.x0 / SOFT_TILE; tx <= (q.x1 - 1) / SOFT_TILE; tx++ )
+			{
+				CORE_SoftBin &bin = ss.bins[ty * ss.tiles_x + tx];
+				if ( bin.count == bin.capacity )
+				{
+					size_t capacity = bin.capacity ? 2 * bin.capacity : 256;
+					unsigned *quads = (unsigned *)realloc(bin.quads, capacity * sizeof(unsigned));
+					if ( !quads )
+						continue;
+					bin.quads = quads;
+					bin.capacity = capacity;
+				}
+				bin.quads[bin.count++] = index;
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+bool CORE_InitSoftRender(int pix_w, int pix_h, int num_threads)
+{
+	CORE_SoftState &ss = CORE_Soft;
+	if ( ss.active )
+		return true;
+
+	ss.pix_w = pix_w;
+	ss.pix_h = pix_h;
+	ss.tiles_x = (pix_w + SOFT_TILE - 1) / SOFT_TILE;
+	ss.tiles_y = (pix_h + SOFT_TILE - 1) / SOFT_TILE;
+	ss.frame = (dword *)calloc((size_t)pix_w * pix_h, 4);
+	ss.quads = (CORE_SoftQuad *)malloc(SOFT_MAX_QUADS * sizeof(CORE_SoftQuad));
+	ss.bins = (CORE_SoftBin *)calloc(ss.tiles_x * ss.tiles_y, sizeof(CORE_SoftBin));
+	if ( !ss.frame || !ss.quads || !ss.bins )
+	{
+		free(ss.frame);
+		free(ss.quads);
+		free(ss.bins);
+		memset(&ss, 0, sizeof(ss));
+		return false;
+	}
+
+	// Texture to show the frame with, see CORE_PresentSoft()
+	glGenTextures(1, &ss.present_tex);
+	CORE_BindTexture(ss.present_tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, hp2(pix_w), hp2(pix_h), 0, GL_BGRA_EXT, GL_UNSIGNED_BYTE, NULL);
+
+	// The calling thread draws tiles too
+	if ( num_threads <= 0 )
+		num_threads = (int)std::thread::hardware_concurrency();
+	num_threads = num_threads < 1 ? 1 : num_threads > SOFT_MAX_THREADS ? SOFT_MAX_THREADS : num_threads;
+	ss.quit = false;
+	ss.job = 0;
+	for ( ss.num_workers = 0; ss.num_workers < num_threads - 1; ss.num_workers++ )
+		CORE_SoftWorkers[ss.num_workers] = std::thread(CORE_SoftWorker);
+
+	CORE_SoftKeepTextures = true;
+	ss.active = true;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+void CORE_EndSoftRender()
+{
+	CORE_SoftState &ss = CORE_Soft;
+	if ( !ss.active )
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(CORE_SoftMutex);
+		ss.quit = true;
+	}
+	CORE_SoftWake.notify_all();
+	for ( int i = 0; i < ss.num_workers; i++ )
+		CORE_SoftWorkers[i].join();
+
+	for ( int i = 0; i < ss.tiles_x * ss.tiles_y; i++ )
+		free(ss.bins[i].quads);
+	free(ss.bins);
+	free(ss.quads);
+	free(ss.frame);
+	CORE_ForgetTexture(ss.present_tex);
+	glDeleteTextures(1, &ss.present_tex);
+	memset(&ss, 0, sizeof(ss));
+
+	// Textures loaded from now on go to GL only
+	CORE_SoftKeepTextures = false;
+}
+
+//-----------------------------------------------------------------------------
+bool CORE_IsSoftRender()
+{
+	return CORE_Soft.active;
+}
+
+//-----------------------------------------------------------------------------
+void CORE_SetView(float view_w, float view_h)
+{
+	CORE_FlushSprites();
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	glOrtho(0.0, view_w, 0.0, view_h, 0.0, 1.0);
+
+	CORE_View[0] = 2.f / view_w;
+	CORE_View[1] = 2.f / view_h;
+	CORE_View[2] = -1.f;
+	CORE_View[3] = -1.f;
+}
+
+//-----------------------------------------------------------------------------
+void CORE_FlushSprites()
+{
+	if ( !CORE_BatchCount )
+		return;
+
+	if ( CORE_Soft.active )
+		CORE_FlushSoft();
+	else if ( CORE_Instanced.active )
+		CORE_FlushInstanced();
+	else
+		CORE_FlushLegacy();
+	CORE_BatchCount = 0;
+}
+
+//-----------------------------------------------------------------------------
+inline byte CORE_ColorByte(float c)
+{
+	return (byte)(c <= 0.f ? 0 : c >= 1.f ? 255 : (int)(c * 255.f + .5f));
+}
+
+//-----------------------------------------------------------------------------
+void CORE_Clear(rgba color)
+{
+	CORE_SoftState &ss = CORE_Soft;
+	if ( ss.active )
+	{
+		// Anything still waiting to be drawn would be covered up
+		CORE_BatchCount = 0;
+		for ( int i = 0; i < ss.tiles_x * ss.tiles_y; i++ )
+			ss.bins[i].count = 0;
+		ss.num_quads = 0;
+		ss.clear = true;
+		ss.clear_color = CORE_ColorByte(color.b) | CORE_ColorByte(color.g) << 8
+			| CORE_ColorByte(color.r) << 16 | (dword)CORE_ColorByte(color.a) << 24;
+		return;
+	}
+
+	CORE_FlushSprites();
+	glClearColor(color.r, color.g, color.b, color.a);
+	glClear(GL_COLOR_BUFFER_BIT);
+}
+
+//-----------------------------------------------------------------------------
+void CORE_PresentSoft()
+{
+	CORE_SoftState &ss = CORE_Soft;
+	if ( !ss.active )
+		return;
+	CORE_FlushSprites();
+	CORE_SoftRasterize();
+
+	// One quad over the whole viewport, replacing whatever was there
+	CORE_BindTexture(ss.present_tex);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, ss.pix_w, ss.pix_h, GL_BGRA_EXT, GL_UNSIGNED_BYTE, ss.frame);
+	CORE_BlendFunc(GL_ONE, GL_ZERO);
+	CORE_UseProgram(0);
+
+	float u1 = ss.pix_w / (float)hp2(ss.pix_w), v1 = ss.pix_h / (float)hp2(ss.pix_h);
+	glPushMatrix();
+	glLoadIdentity();
+	glColor4f(1.f, 1.f, 1.f, 1.f);
+	glBegin(GL_QUADS);
+	glTexCoord2d(0.0, 0.0); glVertex2f(-1.f, -1.f);
+	glTexCoord2d(u1, 0.0);  glVertex2f( 1.f, -1.f);
+	glTexCoord2d(u1, v1);   glVertex2f( 1.f,  1.f);
+	glTexCoord2d(0.0, v1);  glVertex2f(-1.f,  1.f);
+	glEnd();
+	glPopMatrix();
+}
+
+//-----------------------------------------------------------------------------
+bool CORE_DumpSoftFrame(const char filename[])
+{
+	const CORE_SoftState &ss = CORE_Soft;
+	if ( !ss.active )
+		return false;
+	FILE *f = fopen(filename, "wb");
+	if ( !f )
+		return false;
+
+	// Same layout CORE_LoadBmp() reads: 32 bpp, bottom row first
+	dword pixdatasize = (dword)ss.pix_w * ss.pix_h * 4;
+	CORE_BMPFileHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.mark[0] = 'B';
+	hdr.mark[1] = 'M';
+	WriteDWord(hdr.filesize, sizeof(hdr) + pixdatasize);
+	WriteDWord(hdr.pixdataoffset, sizeof(hdr));
+	WriteDWord(hdr.hdrsize, sizeof(hdr) - offsetof(CORE_BMPFileHeader, hdrsize));
+	WriteDWord(hdr.width, ss.pix_w);
+	WriteDWord(hdr.height, ss.pix_h);
+	WriteWord(hdr.colorplanes, 1);
+	WriteWord(hdr.bpp, 32);
+	WriteDWord(hdr.pixdatasize, pixdatasize);
+
+	bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 && fwrite(ss.frame, pixdatasize, 1, f) == 1;
+	return fclose(f) == 0 && ok;
+}
+
+//-----------------------------------------------------------------------------
+// Queues a quad from (x0,y0) to (x1,y1) mapped to texture coords (u0,v0)..(u1,v1)
+static void CORE_BatchQuad(GLuint tex, bool additive, float x0, float y0, float x1, float y1,
+	float u0, float v0, float u1, float v1, rgba color)
+{
+	if ( CORE_BatchCount == BATCH_MAX_QUADS || (CORE_BatchCount && tex != CORE_BatchTex) )
+		CORE_FlushSprites();
+	CORE_BatchTex = tex;
+
+	float a = color.a <= 0.f ? 0.f : color.a >= 1.f ? 1.f : color.a;
+	CORE_SpriteQuad &q = CORE_BatchQuads[CORE_BatchCount++];
+	q.x0 = x0; q.y0 = y0; q.x1 = x1; q.y1 = y1;
+	q.u0 = u0; q.v0 = v0; q.u1 = u1; q.v1 = v1;
+	q.r = CORE_ColorByte(color.r * a);
+	q.g = CORE_ColorByte(color.g * a);
+	q.b = CORE_ColorByte(color.b * a);
+	q.a = additive ? 0 : CORE_ColorByte(a);
+}
 
 //-----------------------------------------------------------------------------
-struct CORE_BMPFileHeader
+void CORE_RenderCenteredSprite(vec2 pos, vec2 size, int texture_index, rgba color, bool additive)
 {
-	byte  mark[2];
-	byte  filesize[4];
-	byte  reserved[4];
-	byte  pixdataoffset[4];
+	const Texture &t = CORE_Tex(texture_index);
+	CORE_BatchQuad(t.tex, additive, pos.x - .5f * size.x, pos.y - .5f * size.y,
+		pos.x + .5f * size.x, pos.y + .5f * size.y, t.u0, t.v0, t.u1, t.v1, color);
+}
 
-	byte  hdrsize[4];
-	byte  width[4];
-	byte  height[4];
-	byte  colorplanes[2];
-	byte  bpp[2];
-	byte  compression[4];
-	byte  pixdatasize[4];
-	byte  hres[4];
-	byte  vres[4];
-	byte  numcol[4];
-	byte  numimportantcolors[4];
-};
+//-----------------------------------------------------------------------------
+void CORE_RenderSprites(const SpriteInstance sprites[], size_t n)
+{
+	for ( size_t i = 0; i < n; i++ )
+		CORE_RenderCenteredSprite(sprites[i].pos, sprites[i].size, sprites[i].texture,
+			sprites[i].color, sprites[i].additive);
+}
 
 //-----------------------------------------------------------------------------
-// Utility functions
-template<typename T>
-inline word ReadWord(const T a[])	{ return (a[0] + a[1]*0x100); }
-template<typename T>
-inline dword ReadDWord(const T a[]) { return (a[0] + a[1] * 0x100 + a[2] * 0x10000 + a[3] * 0x1000000); }
+static const int FONT_GLYPHS_PER_ROW = 8;
+static const int FONT_FIRST_CHAR = ' ';
+static const int FONT_LAST_CHAR = '_';
 
-// Next higher power of 2
-dword hp2(dword v)
+void CORE_RenderText(vec2 pos, float size, const char text[], int font_texture, rgba color)
 {
-	v--;
-	v |= v >> 1;
-	v |= v >> 2;
-	v |= v >> 4;
-	v |= v >> 8;
-	v |= v >> 16;
-	v++; 
-	return v += (v == 0);
+	// Glyph cell size in texture space. Rows were flipped on load, so the
+	// first glyph row is at the top (v = v1) of the texture rectangle.
+	const Texture &t = CORE_Tex(font_texture);
+	float gw = (t.u1 - t.u0) / FONT_GLYPHS_PER_ROW;
+	float gh = (t.v1 - t.v0) / FONT_GLYPHS_PER_ROW;
+
+	float x = pos.x;
+	for ( const char *p = text; *p; p++, x += size )
+	{
+		int c = toupper((byte)*p);
+		if ( c == ' ' )
+			continue;
+		if ( c < FONT_FIRST_CHAR || c > FONT_LAST_CHAR )
+			c = '?';
+
+		int glyph = c - FONT_FIRST_CHAR;
+		float u0 = t.u0 + (glyph % FONT_GLYPHS_PER_ROW) * gw;
+		float v1 = t.v1 - (glyph / FONT_GLYPHS_PER_ROW) * gh;
+		float v0 = v1 - gh;
+
+		CORE_BatchQuad(t.tex, false, x, pos.y - size, x + size, pos.y,
+			u0, v0, u0 + gw, v1, color);
+	}
+}
+
+//-----------------------------------------------------------------------------
+void CORE_RenderTexturedRect(vec2 p0, vec2 p1, int texture_index, vec2 uv0, vec2 uv1, rgba color)
+{
+	const Texture &t = CORE_Tex(texture_index);
+	float du = t.u1 - t.u0, dv = t.v1 - t.v0;
+	CORE_BatchQuad(t.tex, false, p0.x, p0.y, p1.x, p1.y,
+		t.u0 + uv0.x * du, t.v0 + uv0.y * dv, t.u0 + uv1.x * du, t.v0 + uv1.y * dv, color);
 }
 
-// Pixel load buffer
-static byte pixloadbuffer[2048 * 2048 * 4];
+//=============================================================================
+// Render targets: textures with a framebuffer object (GL 3.x) attached, that
+// the sprite functions can draw into between Begin/EndRenderTarget.
 
-// Core functions
-int CORE_LoadBmp(const char filename[], bool wrap)
+struct CORE_RenderTargetState
+{
+	int   target;			// Texture index being drawn into, -1 for the window
+	GLint viewport[4];		// The window's, restored at the end
+	float view[4];			// And its CORE_View
+};
+
+CORE_RenderTargetState CORE_RT = { -1, { 0 }, { 0 } };
+
+//-----------------------------------------------------------------------------
+int CORE_CreateRenderTarget(int pix_w, int pix_h)
 {
-	GLint	retval = -1;
-	struct	CORE_BMPFileHeader hdr;
+	int retval = -1;
+	if ( CORE_Soft.active )
+		return retval;	// The software renderer can't sample what the GPU drew
+	if ( (retval = CORE_ReserveTexture(NULL, false)) == -1 )
+		return retval;
 
-	int fd = open(filename, O_RDONLY);
-	if ( fd != -1 )
+	dword width_pow2 = hp2(pix_w);
+	dword height_pow2 = hp2(pix_h);
+
+	GLuint texid = 0, fbo = 0;
+	glGenTextures(1, &texid);
+	CORE_BindTexture(texid);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width_pow2, height_pow2, 0, GL_BGRA_EXT, GL_UNSIGNED_BYTE, NULL);
+
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texid, 0);
+	bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	if ( !complete )
 	{
-		read(fd, &hdr, sizeof(hdr));
+		glDeleteFramebuffers(1, &fbo);
+		CORE_ForgetTexture(texid);
+		glDeleteTextures(1, &texid);
+		CORE_ReleaseTexture(retval);
+		return -1;
+	}
 
-		if ( hdr.mark[0] == 'B' && hdr.mark[1] == 'M' )
-		{
-			// Find an empty texture entry
-			for ( int i = 0; i < MAX_TEXTURES; i++ )
-			{
-				if ( !g_textures[i].used )
-				{
-					retval = i;
-					break;
-				}
-			}
+	Texture &t = *CORE_TexSlot(retval);
+	t.pix_w = pix_w;
+	t.pix_h = pix_h;
+	t.page = -1;
+	t.tex = texid;
+	t.fbo = fbo;
+	t.u0 = 0.f;
+	t.v0 = 0.f;
+	t.u1 = pix_w / (float)width_pow2;
+	t.v1 = pix_h / (float)height_pow2;
+	return retval;
+}
 
-			if ( retval == -1 )
-				return retval;
+//-----------------------------------------------------------------------------
+void CORE_BeginRenderTarget(int texture_index)
+{
+	const Texture &t = CORE_Tex(texture_index);
+	CORE_FlushSprites();
 
-			dword  width = ReadDWord(hdr.width);
-			sdword height = ReadDWord(hdr.height);
-			dword  offset = ReadDWord(hdr.pixdataoffset);
+	CORE_RT.target = texture_index;
+	memset(CORE_RT.viewport, 0, sizeof(CORE_RT.viewport));
+	glGetIntegerv(GL_VIEWPORT, CORE_RT.viewport);
+	memcpy(CORE_RT.view, CORE_View, sizeof(CORE_RT.view));
 
-			dword pixdatasize = ReadDWord(hdr.pixdatasize);
-			if ( !pixdatasize )
-				pixdatasize = (width * abs(height) * ReadWord(hdr.bpp) / 8);
+	glBindFramebuffer(GL_FRAMEBUFFER, t.fbo);
+	glViewport(0, 0, t.pix_w, t.pix_h);
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	CORE_SetView((float)t.pix_w, (float)t.pix_h);
+}
 
-			lseek(fd, offset, SEEK_SET);
-			if ( height > 0 )
-				read(fd, pixloadbuffer, pixdatasize);
-			else
-			{
-				// Reverse while loading
-				int nrows = -height;
-				for ( int i = 0; i < nrows; i++ )
-					read(fd, pixloadbuffer + (nrows - i - 1) * width * 4, (pixdatasize / nrows));
-			}
+//-----------------------------------------------------------------------------
+void CORE_EndRenderTarget()
+{
+	if ( CORE_RT.target < 0 )
+		return;
+	CORE_FlushSprites();
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(CORE_RT.viewport[0], CORE_RT.viewport[1], CORE_RT.viewport[2], CORE_RT.viewport[3]);
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	memcpy(CORE_View, CORE_RT.view, sizeof(CORE_RT.view));
+	CORE_RT.target = -1;
+}
+
+//=============================================================================
+// GPU tilemaps (GL 3.3): the map is an 8 bit integer texture of tile numbers
+// and the tiles are the layers of a texture array. One quad covers the whole
+// area, and the fragment shader finds the cell, then the texel in its tile.
+
+static const int TILEMAP_MAX = 4;
 
-			GLuint texid = 1;
+struct CORE_TileMap
+{
+	bool   used;
+	int    cols, rows;
+	float  tile_w, tile_h;	// Size of a cell in view units
+	int    num_tiles;
+	GLuint index_tex;		// cols x rows, GL_R8UI
+	GLuint tiles_tex;		// GL_TEXTURE_2D_ARRAY, num_tiles layers
+};
+
+struct CORE_TileMapProgram
+{
+	GLuint program;
+	GLuint vao;				// Empty, the corners come from gl_VertexID
+	GLint  view_loc, rect_loc, scroll_loc, tile_size_loc;
+	int    users;
+};
+
+CORE_TileMap        CORE_TileMaps[TILEMAP_MAX];
+CORE_TileMapProgram CORE_TileMapProg = {};
+
+static const char *CORE_TILEMAP_VS =
+	"#version 330 core\n"
+	"uniform vec4 view;\n"
+	"uniform vec4 rect;\n"
+	"uniform vec2 scroll;\n"
+	"out vec2 world;\n"
+	"void main()\n"
+	"{\n"
+	"	vec2 p = mix(rect.xy, rect.zw, vec2(gl_VertexID & 1, gl_VertexID >> 1));\n"
+	"	world = p + scroll;\n"
+	"	gl_Position = vec4(p * view.xy + view.zw, 0.0, 1.0);\n"
+	"}\n";
+
+static const char *CORE_TILEMAP_FS =
+	"#version 330 core\n"
+	"uniform sampler2DArray tiles;\n"
+	"uniform usampler2D map;\n"
+	"uniform vec2 tile_size;\n"
+	"in vec2 world;\n"
+	"out vec4 frag;\n"
+	"void main()\n"
+	"{\n"
+	"	vec2 cell = world / tile_size;\n"
+	"	ivec2 size = textureSize(map, 0);\n"
+	"	ivec2 c = ivec2(mod(floor(cell), vec2(size)));\n"
+	"	uint tile = texelFetch(map, c, 0).r;\n"
+	"	frag = texture(tiles, vec3(fract(cell), float(tile)));\n"
+	"}\n";
+
+//-----------------------------------------------------------------------------
+static bool CORE_InitTileMapProgram()
+{
+	CORE_TileMapProgram &tp = CORE_TileMapProg;
+	if ( tp.program )
+		return true;
+
+	GLuint vs = CORE_CompileShader(GL_VERTEX_SHADER, CORE_TILEMAP_VS);
+	GLuint fs = CORE_CompileShader(GL_FRAGMENT_SHADER, CORE_TILEMAP_FS);
+	if ( !vs || !fs )
+	{
+		if ( vs ) glDeleteShader(vs);
+		if ( fs ) glDeleteShader(fs);
+		return false;
+	}
 
-			glGenTextures(1, &texid);
-			glBindTexture(GL_TEXTURE_2D, texid);
-			//glTexEnvf( GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE );
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST); // GL_LINEAR_MIPMAP_NEAREST
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST); // GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap ? GL_REPEAT : GL_CLAMP);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrap ? GL_REPEAT : GL_CLAMP);
+	tp.program = glCreateProgram();
+	glAttachShader(tp.program, vs);
+	glAttachShader(tp.program, fs);
+	glLinkProgram(tp.program);
+	glDeleteShader(vs);
+	glDeleteShader(fs);
 
-			//gluBuild2DMipmaps( GL_TEXTURE_2D, GL_RGBA8, width, height, GL_BGRA_EXT, GL_UNSIGNED_BYTE, pixloadbuffer );
+	GLint ok = 0;
+	glGetProgramiv(tp.program, GL_LINK_STATUS, &ok);
+	if ( !ok )
+	{
+		glDeleteProgram(tp.program);
+		tp.program = 0;
+		return false;
+	}
 
-			height = abs((int)height);
-			dword width_pow2 = hp2(width);
-			dword height_pow2 = hp2(height);
+	tp.view_loc = glGetUniformLocation(tp.program, "view");
+	tp.rect_loc = glGetUniformLocation(tp.program, "rect");
+	tp.scroll_loc = glGetUniformLocation(tp.program, "scroll");
+	tp.tile_size_loc = glGetUniformLocation(tp.program, "tile_size");
+	CORE_UseProgram(tp.program);
+	glUniform1i(glGetUniformLocation(tp.program, "tiles"), 0);
+	glUniform1i(glGetUniformLocation(tp.program, "map"), 1);
 
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width_pow2, height_pow2, 0, GL_BGRA_EXT, GL_UNSIGNED_BYTE, NULL);
-			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_BGRA_EXT, GL_UNSIGNED_BYTE, pixloadbuffer);
+	glGenVertexArrays(1, &tp.vao);
+	return true;
+}
 
-			g_textures[retval].used = true;
-			g_textures[retval].tex = texid;
-			g_textures[retval].pix_w = width;
-			g_textures[retval].pix_h = height;
-			g_textures[retval].w = width / (float)width_pow2;
-			g_textures[retval].h = height / (float)height_pow2;
+//-----------------------------------------------------------------------------
+int CORE_CreateTileMap(int cols, int rows, float tile_w, float tile_h)
+{
+	int retval = -1;
+	if ( CORE_Soft.active )
+		return retval;
+	for ( int i = 0; i < TILEMAP_MAX; i++ )
+	{
+		if ( !CORE_TileMaps[i].used )
+		{
+			retval = i;
+			break;
 		}
-		close(fd);
 	}
+	if ( retval == -1 || !CORE_InitTileMapProgram() )
+		return -1;
 
+	CORE_TileMap &tm = CORE_TileMaps[retval];
+	tm.used = true;
+	tm.cols = cols;
+	tm.rows = rows;
+	tm.tile_w = tile_w;
+	tm.tile_h = tile_h;
+	tm.num_tiles = 0;
+	tm.tiles_tex = 0;
+
+	// Integer textures can't be filtered
+	glGenTextures(1, &tm.index_tex);
+	CORE_BindTexture(tm.index_tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8UI, cols, rows, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, NULL);
+
+	CORE_TileMapProg.users++;
 	return retval;
 }
+
 //-----------------------------------------------------------------------------
-void CORE_UnloadBmp(int texture_index)
+void CORE_DestroyTileMap(int map)
 {
-	glDeleteTextures(1, &g_textures[texture_index].tex);
-	g_textures[texture_index].used = false;
+	CORE_TileMap &tm = CORE_TileMaps[map];
+	if ( !tm.used )
+		return;
+
+	CORE_ForgetTexture(tm.index_tex);
+	glDeleteTextures(1, &tm.index_tex);
+	if ( tm.tiles_tex )
+		glDeleteTextures(1, &tm.tiles_tex);
+	tm.used = false;
+
+	CORE_TileMapProgram &tp = CORE_TileMapProg;
+	if ( !--tp.users )
+	{
+		CORE_UseProgram(0);
+		CORE_BindVertexArray(0);
+		glDeleteVertexArrays(1, &tp.vao);
+		glDeleteProgram(tp.program);
+		memset(&tp, 0, sizeof(tp));
+	}
 }
 
 //-----------------------------------------------------------------------------
-ivec2 CORE_GetBmpSize(int texture_index)
+// The layers are copied on the GPU, from wherever the textures live (atlas
+// pages included), through a framebuffer reading from each one in turn.
+bool CORE_SetTileMapTiles(int map, const int textures[], int num_textures)
 {
-	ivec2 v;
-	v.x = g_textures[texture_index].pix_w;
-	v.y = g_textures[texture_index].pix_h;
-	return v;
+	CORE_TileMap &tm = CORE_TileMaps[map];
+	if ( num_textures <= 0 || num_textures > 256 )
+		return false;
+
+	int w = CORE_Tex(textures[0]).pix_w;
+	int h = CORE_Tex(textures[0]).pix_h;
+	for ( int i = 1; i < num_textures; i++ )
+		if ( CORE_Tex(textures[i]).pix_w != w || CORE_Tex(textures[i]).pix_h != h )
+			return false;
+
+	CORE_FlushSprites();
+	if ( tm.tiles_tex )
+		glDeleteTextures(1, &tm.tiles_tex);
+	glGenTextures(1, &tm.tiles_tex);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, tm.tiles_tex);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA, w, h, num_textures, 0, GL_BGRA_EXT, GL_UNSIGNED_BYTE, NULL);
+
+	GLuint fbo = 0;
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+	for ( int i = 0; i < num_textures; i++ )
+	{
+		// Pixel position in the source texture, from its UV rectangle
+		const Texture &t = CORE_Tex(textures[i]);
+		int x = (int)(t.u0 * t.pix_w / (t.u1 - t.u0) + .5f);
+		int y = (int)(t.v0 * t.pix_h / (t.v1 - t.v0) + .5f);
+		glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, t.tex, 0);
+		glCopyTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, x, y, w, h);
+	}
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	glDeleteFramebuffers(1, &fbo);
+
+	tm.num_tiles = num_textures;
+	return true;
 }
 
 //-----------------------------------------------------------------------------
-GLuint CORE_GetBmpOpenGLTex(int texture_index)
+void CORE_SetTileMapRow(int map, int row, const byte tiles[])
 {
-	return g_textures[texture_index].tex;
+	const CORE_TileMap &tm = CORE_TileMaps[map];
+	CORE_BindTexture(tm.index_tex);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, row, tm.cols, 1, GL_RED_INTEGER, GL_UNSIGNED_BYTE, tiles);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 }
 
 //-----------------------------------------------------------------------------
-void CORE_RenderCenteredSprite(vec2 pos, vec2 size, int texture_index, rgba color, bool additive)
+void CORE_RenderTileMap(int map, vec2 p0, vec2 p1, vec2 scroll)
 {
-	glColor4f(color.r, color.g, color.b, color.a);
-	if (additive)
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-	else
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-	
-	vec2 p0 = vsub(pos, vscale(size, .5f));
-	vec2 p1 = vadd(pos, vscale(size, .5f));
+	const CORE_TileMap &tm = CORE_TileMaps[map];
+	const CORE_TileMapProgram &tp = CORE_TileMapProg;
+	if ( !tm.num_tiles )
+		return;
 
-	glBindTexture(GL_TEXTURE_2D, g_textures[texture_index].tex);
-	glBegin(GL_QUADS);
-	glTexCoord2d(0.0, 0.0);													glVertex2f(p0.x, p0.y);
-	glTexCoord2d(g_textures[texture_index].w, 0.0);							glVertex2f(p1.x, p0.y);
-	glTexCoord2d(g_textures[texture_index].w, g_textures[texture_index].h); glVertex2f(p1.x, p1.y);
-	glTexCoord2d(0.0, g_textures[texture_index].h);							glVertex2f(p0.x, p1.y);
-	glEnd();
+	CORE_FlushSprites();
+	CORE_BlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, tm.index_tex);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, tm.tiles_tex);
+
+	CORE_UseProgram(tp.program);
+	glUniform4f(tp.view_loc, CORE_View[0], CORE_View[1], CORE_View[2], CORE_View[3]);
+	glUniform4f(tp.rect_loc, p0.x, p0.y, p1.x, p1.y);
+	glUniform2f(tp.scroll_loc, scroll.x, scroll.y);
+	glUniform2f(tp.tile_size_loc, tm.tile_w, tm.tile_h);
+	CORE_BindVertexArray(tp.vao);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 }
 
 //=============================================================================
@@ -289,83 +2266,98 @@ struct CORE_WAVEFormatChunk
 };
 
 //-----------------------------------------------------------------------------
-static const size_t MAX_WAV_SIZE = 32*1024*1024; // Max 32Mb sound!
-static byte sound_load_buffer[MAX_WAV_SIZE];
+// PCM samples of a WAV file, ready for alBufferData()
+struct CORE_WavSound
+{
+	const byte *data;
+	ALsizei     size;
+	ALenum      format;
+	ALsizei     frequency;
+};
 
-ALuint CORE_LoadWav(const char filename[])
+//-----------------------------------------------------------------------------
+// Finds the samples of a WAV file in memory, false if it's not one we can use
+static bool CORE_ParseWav(const byte file[], size_t file_size, CORE_WavSound &snd)
 {
-	ALuint			retval = UINT_MAX;
-	CORE_RIFFHeader hdr;
+	const CORE_RIFFHeader &hdr = *(const CORE_RIFFHeader *)file;
+	if (file_size < sizeof(hdr)
+		|| hdr.chunk_ID[0] != 'R' || hdr.chunk_ID[1] != 'I' || hdr.chunk_ID[2] != 'F' || hdr.chunk_ID[3] != 'F'
+		|| hdr.format[0] != 'W' || hdr.format[1] != 'A' || hdr.format[2] != 'V' || hdr.format[3] != 'E')
+		return false;
+
+	CORE_WAVEFormatChunk fmt;
+	memset(&fmt, 0, sizeof(fmt));
 
-	int fd = open(filename, O_RDONLY);
-	if (fd != 1)
+	for (size_t pos = sizeof(hdr); file_size - pos >= sizeof(CORE_RIFFChunkHeader); )
 	{
-		read(fd, &hdr, sizeof(hdr));
+		const CORE_RIFFChunkHeader &chunk_hdr = *(const CORE_RIFFChunkHeader *)(file + pos);
+		const byte *chunk_data = file + pos + sizeof(chunk_hdr);
+		size_t chunk_data_size = ReadDWord(chunk_hdr.sub_chunk_size);
+		size_t file_left = file_size - pos - sizeof(chunk_hdr);
+		if (chunk_data_size > file_left)
+			chunk_data_size = file_left;	// Cut short, take what's there
 
-		if (hdr.chunk_ID[0] == 'R' && hdr.chunk_ID[1] == 'I' && hdr.chunk_ID[2] == 'F' && hdr.chunk_ID[3] =='F'
-			&& hdr.format[0] == 'W' && hdr.format[1] == 'A' && hdr.format[2] == 'V' && hdr.format[3] == 'E')
+		if (chunk_hdr.sub_chunk_ID[0] == 'f' && chunk_hdr.sub_chunk_ID[1] == 'm' &&
+			chunk_hdr.sub_chunk_ID[2] == 't' && chunk_hdr.sub_chunk_ID[3] == ' ')
 		{
-			CORE_WAVEFormatChunk fmt;
-			memset(&fmt, 0, sizeof(fmt));
-
-			while(true)
+			memcpy(&fmt, chunk_data, chunk_data_size < sizeof(fmt) ? chunk_data_size : sizeof(fmt));
+		}
+		else if (chunk_hdr.sub_chunk_ID[0] == 'd' && chunk_hdr.sub_chunk_ID[1] == 'a' &&
+			chunk_hdr.sub_chunk_ID[2] == 't' && chunk_hdr.sub_chunk_ID[3] == 'a')
+		{
+			snd.data = chunk_data;
+			snd.size = (ALsizei)chunk_data_size;
+			snd.frequency = ReadDWord(fmt.sample_rate);
+			if (ReadWord(fmt.num_channels) == 1)
 			{
-				CORE_RIFFChunkHeader chunk_hdr;
-				if (read(fd, &chunk_hdr, sizeof(chunk_hdr)) < sizeof(chunk_hdr))
-					break;
-
-				dword chunk_data_size = ReadDWord(chunk_hdr.sub_chunk_size);
-					
-				if (chunk_hdr.sub_chunk_ID[0] == 'f' && chunk_hdr.sub_chunk_ID[1] == 'm' &&
-					chunk_hdr.sub_chunk_ID[2] == 't' && chunk_hdr.sub_chunk_ID[3] == ' ')
-				{
-					read(fd, &fmt, sizeof(fmt));
-					lseek(fd, ((1 + chunk_data_size) & -2) - sizeof(fmt), SEEK_CUR); // Skip to next chunk
-				}
-				else if (chunk_hdr.sub_chunk_ID[0] == 'd' && chunk_hdr.sub_chunk_ID[1] == 'a' &&
-					chunk_hdr.sub_chunk_ID[2] == 't' && chunk_hdr.sub_chunk_ID[3] == 'a')
-				{
-					dword content_size = chunk_data_size;
-					if (content_size > sizeof(sound_load_buffer))
-						content_size = sizeof(sound_load_buffer);
-
-					read(fd, sound_load_buffer, content_size);
-					
-					bool valid = true;
-					ALsizei al_size = content_size;
-					ALsizei al_frequency = ReadDWord(fmt.sample_rate);
-					ALenum al_format = (ALenum)-1;
-					if (ReadWord(fmt.num_channels) == 1)
-					{
-						if (ReadWord(fmt.bits_per_sample) == 8) al_format = AL_FORMAT_MONO8;
-						else if (ReadWord(fmt.bits_per_sample) == 16) al_format = AL_FORMAT_MONO16;
-						else valid = false;
-					}
-					else if (ReadWord(fmt.num_channels) == 2)
-					{
-						if (ReadWord(fmt.bits_per_sample) == 8) al_format = AL_FORMAT_STEREO8;
-						else if (ReadWord(fmt.bits_per_sample) == 16) al_format = AL_FORMAT_STEREO16;
-						else valid = false;
-					}
-
-					if (valid)
-					{
-						ALuint al_buffer = UINT_MAX;
-						alGenBuffers(1, &al_buffer);
-
-						alBufferData(al_buffer, al_format, sound_load_buffer, al_size, al_frequency);
-						retval = al_buffer;
-					}
-					break;
-				}
-				else
-				{
-					lseek(fd, ((1 + ReadDWord(chunk_hdr.sub_chunk_size)) & -2), SEEK_CUR); //Skip to next chunk
-				}
+				if (ReadWord(fmt.bits_per_sample) == 8) snd.format = AL_FORMAT_MONO8;
+				else if (ReadWord(fmt.bits_per_sample) == 16) snd.format = AL_FORMAT_MONO16;
+				else return false;
+			}
+			else if (ReadWord(fmt.num_channels) == 2)
+			{
+				if (ReadWord(fmt.bits_per_sample) == 8) snd.format = AL_FORMAT_STEREO8;
+				else if (ReadWord(fmt.bits_per_sample) == 16) snd.format = AL_FORMAT_STEREO16;
+				else return false;
 			}
+			else
+				return false;
+			return true;
 		}
-		close (fd);
+		pos += sizeof(chunk_hdr) + ((chunk_data_size + 1) & ~(size_t)1);	// Skip to next chunk
+		if (pos > file_size)
+			break;
+	}
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+ALuint CORE_LoadWav(const char filename[])
+{
+	ALuint	retval = UINT_MAX;
+	size_t	file_size = 0;
+
+	const CORE_ArchiveEntry *cooked = CORE_ArchiveFind(filename, ARCHIVE_WAV);
+	if (cooked)
+	{
+		alGenBuffers(1, &retval);
+		alBufferData(retval, ReadDWord(cooked->width), CORE_Archive.file + ReadDWord(cooked->offset),
+			ReadDWord(cooked->size), ReadDWord(cooked->height));
+		return retval;
+	}
+
+	// AL gets the samples straight from the file mapping, no staging copy
+	const byte *file = (const byte *)SYS_MapFile(filename, &file_size);
+	if (!file)
+		return retval;
+
+	CORE_WavSound snd;
+	if (CORE_ParseWav(file, file_size, snd))
+	{
+		alGenBuffers(1, &retval);
+		alBufferData(retval, snd.format, snd.data, snd.size, snd.frequency);
 	}
+	SYS_UnmapFile(file, file_size);
 	return retval;
 }
 
@@ -373,4 +2365,327 @@ ALuint CORE_LoadWav(const char filename[])
 void CORE_UnloadWav(ALuint snd)
 {
 	alDeleteBuffers(1, &snd);
-}
\ No newline at end of file
+}
+//-----------------------------------------------------------------------------
+// Writes an archive for CORE_OpenArchive() with the given BMP & WAV files.
+// Returns how many went in, -1 if it couldn't be written.
+int CORE_CookArchive(const char filename[], const char *const names[], int num_names)
+{
+	dword num_slots = 1;
+	while ( num_slots < 2 * (dword)num_names )
+		num_slots *= 2;
+	CORE_ArchiveEntry *entries = (CORE_ArchiveEntry *)calloc(num_slots, sizeof(CORE_ArchiveEntry));
+	FILE *f = fopen(filename, "wb");
+	if ( !entries || !f )
+	{
+		free(entries);
+		if ( f )
+			fclose(f);
+		return -1;
+	}
+
+	// Payloads first, the header & table go in front once they're known
+	size_t offset = sizeof(CORE_ArchiveHeader) + num_slots * sizeof(CORE_ArchiveEntry);
+	int    num_cooked = 0;
+	bool   ok = true;
+	for ( int i = 0; ok && i < num_names; i++ )
+	{
+		size_t file_size = 0;
+		const byte *file = NULL;
+		if ( strlen(names[i]) >= sizeof(entries[0].name)
+			|| !(file = (const byte *)SYS_MapFile(names[i], &file_size)) )
+			continue;
+
+		// Its slot, unless it's in already
+		dword slot = CORE_HashName(names[i]) & (num_slots - 1);
+		while ( ReadDWord(entries[slot].kind) != ARCHIVE_FREE && strcmp((const char *)entries[slot].name, names[i]) )
+			slot = (slot + 1) & (num_slots - 1);
+		CORE_ArchiveEntry &e = entries[slot];
+
+		CORE_BmpImage img;
+		CORE_WavSound snd;
+		const byte *payload = NULL;
+		byte *buffer = NULL;
+		dword kind = ARCHIVE_FREE, size = 0, width = 0, height = 0;
+		if ( ReadDWord(e.kind) != ARCHIVE_FREE )
+			;
+		else if ( CORE_ParseBmp(file, file_size, img) )
+		{
+			kind = ARCHIVE_BMP;
+			size = img.width * img.height * 4;
+			width = img.width;
+			height = img.height;
+			payload = buffer = (byte *)malloc(size);
+			for ( int row = 0; buffer && row < img.height; row++ )
+				CORE_PremultiplyCopy(buffer + row * img.width * 4, img.pixels + row * img.stride, img.width);
+		}
+		else if ( CORE_ParseWav(file, file_size, snd) )
+		{
+			kind = ARCHIVE_WAV;
+			size = snd.size;
+			width = snd.format;
+			height = snd.frequency;
+			payload = snd.data;
+		}
+
+		if ( payload )
+		{
+			offset = (offset + ARCHIVE_ALIGN - 1) & ~(size_t)(ARCHIVE_ALIGN - 1);
+			ok = offset + size <= 0xFFFFFFFFu && fseek(f, (long)offset, SEEK_SET) == 0
+				&& (!size || fwrite(payload, size, 1, f) == 1);
+			strcpy((char *)e.name, names[i]);
+			WriteDWord(e.kind, kind);
+			WriteDWord(e.offset, (dword)offset);
+			WriteDWord(e.size, size);
+			WriteDWord(e.width, width);
+			WriteDWord(e.height, height);
+			offset += size;
+			num_cooked++;
+		}
+		free(buffer);
+		SYS_UnmapFile(file, file_size);
+	}
+
+	CORE_ArchiveHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.mark, "P7AR", 4);
+	WriteDWord(hdr.version, ARCHIVE_VERSION);
+	WriteDWord(hdr.num_slots, num_slots);
+	ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&hdr, sizeof(hdr), 1, f) == 1
+		&& fwrite(entries, sizeof(CORE_ArchiveEntry), num_slots, f) == num_slots;
+	free(entries);
+	return fclose(f) == 0 && ok ? num_cooked : -1;
+}
+
+//=============================================================================
+// Asynchronous asset loading. Requests get their texture entry / AL buffer
+// straight away and go in a queue. Worker threads map & parse the files into
+// staging memory (premultiplied pixels, a copy of the samples), and the GL/AL
+// thread uploads finished ones in CORE_PumpAssets(), always in request order
+// so atlas layouts don't depend on thread timing.
+static const int ASSET_MAX_JOBS = 256;
+static const int ASSET_MAX_THREADS = 8;
+
+enum { ASSET_BMP, ASSET_WAV };
+
+struct CORE_AssetJob
+{
+	int           kind;
+	char          filename[256];
+	bool          wrap;				// BMP
+	int           texture_index;	// BMP
+	ALuint        sound;			// WAV
+	bool          finished;			// Set by the worker, under CORE_AssetMutex
+	bool          ok;
+	byte         *staging;
+	CORE_BmpImage image;
+	CORE_WavSound wav;
+};
+
+struct CORE_AssetLoaderState
+{
+	bool          active;
+	int           num_workers;
+	bool          quit;
+	CORE_AssetJob jobs[ASSET_MAX_JOBS];
+	int           num_jobs;			// Requested
+	int           num_taken;		// Handed to a worker
+	int           num_uploaded;		// Done with, jobs[num_uploaded] is next
+} CORE_AssetLoader = {};
+
+std::thread             CORE_AssetWorkers[ASSET_MAX_THREADS];
+std::mutex              CORE_AssetMutex;
+std::condition_variable CORE_AssetWake, CORE_AssetDone;
+
+//-----------------------------------------------------------------------------
+// Worker side: file to staging memory, no GL or AL calls
+static void CORE_DecodeAsset(CORE_AssetJob &job)
+{
+	size_t file_size = 0;
+	const byte *file = (const byte *)SYS_MapFile(job.filename, &file_size);
+	if ( !file )
+		return;
+
+	if ( job.kind == ASSET_BMP && CORE_ParseBmp(file, file_size, job.image) )
+	{
+		CORE_BmpImage &img = job.image;
+		job.staging = (byte *)malloc((size_t)img.width * img.height * 4);
+		if ( job.staging )
+		{
+			for ( int row = 0; row < img.height; row++ )
+				CORE_PremultiplyCopy(job.staging + row * img.width * 4, img.pixels + row * img.stride, img.width);
+			img.pixels = job.staging;
+			img.stride = img.width * 4;
+			img.premultiplied = true;
+			job.ok = true;
+		}
+	}
+	else if ( job.kind == ASSET_WAV && CORE_ParseWav(file, file_size, job.wav) )
+	{
+		job.staging = (byte *)malloc(job.wav.size ? job.wav.size : 1);
+		if ( job.staging )
+		{
+			memcpy(job.staging, job.wav.data, job.wav.size);
+			job.wav.data = job.staging;
+			job.ok = true;
+		}
+	}
+	SYS_UnmapFile(file, file_size);
+}
+
+//-----------------------------------------------------------------------------
+static void CORE_AssetWorker()
+{
+	CORE_AssetLoaderState &al = CORE_AssetLoader;
+	std::unique_lock<std::mutex> lock(CORE_AssetMutex);
+	for ( ;; )
+	{
+		while ( !al.quit && al.num_taken == al.num_jobs )
+			CORE_AssetWake.wait(lock);
+		if ( al.quit )
+			return;
+
+		CORE_AssetJob &job = al.jobs[al.num_taken++];
+		lock.unlock();
+		CORE_DecodeAsset(job);
+		lock.lock();
+		job.finished = true;
+		CORE_AssetDone.notify_all();
+	}
+}
+
+//-----------------------------------------------------------------------------
+void CORE_StartAssetLoader(int num_threads)
+{
+	CORE_AssetLoaderState &al = CORE_AssetLoader;
+	if ( al.active )
+		return;
+
+	// The GL thread only uploads, so all of them decode
+	if ( num_threads <= 0 )
+		num_threads = (int)std::thread::hardware_concurrency();
+	num_threads = num_threads < 1 ? 1 : num_threads > ASSET_MAX_THREADS ? ASSET_MAX_THREADS : num_threads;
+	al.quit = false;
+	al.num_jobs = al.num_taken = al.num_uploaded = 0;
+	for ( al.num_workers = 0; al.num_workers < num_threads; al.num_workers++ )
+		CORE_AssetWorkers[al.num_workers] = std::thread(CORE_AssetWorker);
+	al.active = true;
+}
+
+//-----------------------------------------------------------------------------
+void CORE_StopAssetLoader()
+{
+	CORE_AssetLoaderState &al = CORE_AssetLoader;
+	if ( !al.active )
+		return;
+
+	while ( CORE_PumpAssets(true) )
+		;
+	{
+		std::lock_guard<std::mutex> lock(CORE_AssetMutex);
+		al.quit = true;
+	}
+	CORE_AssetWake.notify_all();
+	for ( int i = 0; i < al.num_workers; i++ )
+		CORE_AssetWorkers[i].join();
+	al.num_workers = 0;
+	al.active = false;
+}
+
+//-----------------------------------------------------------------------------
+// Queues a job if there's room, with the queue emptied first when it's all done
+static bool CORE_QueueAsset(int kind, const char filename[], bool wrap, int texture_index, ALuint sound)
+{
+	CORE_AssetLoaderState &al = CORE_AssetLoader;
+	if ( !al.active || strlen(filename) >= sizeof(al.jobs[0].filename) )
+		return false;
+
+	std::lock_guard<std::mutex> lock(CORE_AssetMutex);
+	if ( al.num_uploaded == al.num_jobs )
+		al.num_jobs = al.num_taken = al.num_uploaded = 0;
+	if ( al.num_jobs == ASSET_MAX_JOBS )
+		return false;
+
+	CORE_AssetJob &job = al.jobs[al.num_jobs];
+	memset(&job, 0, sizeof(job));
+	job.kind = kind;
+	strcpy(job.filename, filename);
+	job.wrap = wrap;
+	job.texture_index = texture_index;
+	job.sound = sound;
+	al.num_jobs++;
+	CORE_AssetWake.notify_one();
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+int CORE_LoadBmpAsync(const char filename[], bool wrap)
+{
+	// Cooked ones need no decoding
+	if ( !CORE_AssetLoader.active || CORE_ArchiveFind(filename, ARCHIVE_BMP) )
+		return CORE_LoadBmp(filename, wrap);
+
+	// In (or on its way) already, or a new texture that's blank for now
+	int texture_index = CORE_FindTexture(filename, wrap);
+	if ( texture_index != -1 )
+		return texture_index;
+	texture_index = CORE_ReserveTexture(filename, wrap);
+	if ( texture_index != -1 && !CORE_QueueAsset(ASSET_BMP, filename, wrap, texture_index, 0) )
+	{
+		// Queue full
+		CORE_ReleaseTexture(texture_index);
+		texture_index = CORE_LoadBmp(filename, wrap);
+	}
+	return texture_index;
+}
+
+//-----------------------------------------------------------------------------
+ALuint CORE_LoadWavAsync(const char filename[])
+{
+	if ( !CORE_AssetLoader.active || CORE_ArchiveFind(filename, ARCHIVE_WAV) )
+		return CORE_LoadWav(filename);
+
+	ALuint snd = UINT_MAX;
+	alGenBuffers(1, &snd);
+	if ( !CORE_QueueAsset(ASSET_WAV, filename, false, -1, snd) )
+	{
+		alDeleteBuffers(1, &snd);
+		snd = CORE_LoadWav(filename);
+	}
+	return snd;
+}
+
+//-----------------------------------------------------------------------------
+int CORE_PumpAssets(bool wait)
+{
+	CORE_AssetLoaderState &al = CORE_AssetLoader;
+	if ( !al.active )
+		return 0;
+
+	int first, last;
+	{
+		std::unique_lock<std::mutex> lock(CORE_AssetMutex);
+		first = al.num_uploaded;
+		while ( wait && first < al.num_jobs && !al.jobs[first].finished )
+			CORE_AssetDone.wait(lock);
+		for ( last = first; last < al.num_jobs && al.jobs[last].finished; last++ )
+			;
+	}
+
+	// Finished jobs aren't touched by the workers anymore. Textures unloaded
+	// while their job was queued are skipped, their handle is stale.
+	for ( int i = first; i < last; i++ )
+	{
+		CORE_AssetJob &job = al.jobs[i];
+		if ( job.ok && job.kind == ASSET_BMP && CORE_Tex(job.texture_index).used )
+			CORE_UploadBmp(job.texture_index, job.image, job.wrap);
+		else if ( job.ok && job.kind == ASSET_WAV )
+			alBufferData(job.sound, job.wav.format, job.wav.data, job.wav.size, job.wav.frequency);
+		free(job.staging);
+		job.staging = NULL;
+	}
+
+	std::lock_guard<std::mutex> lock(CORE_AssetMutex);
+	al.num_uploaded = last;
+	return al.num_jobs - al.num_uploaded;
+}
@@ -6,12 +6,43 @@
 #define P7_CORE_H_
 
 //-----------------------------------------------------------------------------
-// Random generation functions
-inline float	CORE_FRand(float from, float to) { return from + (to - from) 
-				* (rand() / (float)RAND_MAX); }
-inline unsigned CORE_URand(unsigned from, unsigned to) { return from + rand() 
-				% (unsigned)(to - from + 1); }
-inline bool		CORE_RandChance(float chance) { return CORE_FRand(0.f, 1.f) < chance; }
+// Random generation functions (PCG32, same sequences on every platform)
+// Each stream is an independent sequence, so e.g. particle effects can't
+// change the level layout. CORE_SeedRand() reseeds them all.
+enum
+{
+	CORE_RAND_GAMEPLAY,
+	CORE_RAND_LEVEL,
+	CORE_RAND_TERRAIN,
+	CORE_RAND_PARTICLES,
+	CORE_RAND_STREAMS
+};
+
+struct CORE_RandState { qword state, inc; };
+extern CORE_RandState CORE_RandStreams[CORE_RAND_STREAMS];
+
+void	CORE_SeedRand(unsigned seed);
+void	CORE_FRandFill(float out[], size_t n, float from, float to, int stream = CORE_RAND_GAMEPLAY);
+
+inline dword	CORE_Rand32(int stream = CORE_RAND_GAMEPLAY)
+{
+	CORE_RandState &rs = CORE_RandStreams[stream];
+	qword old = rs.state;
+	rs.state = old * 6364136223846793005ULL + rs.inc;
+	dword xorshifted = (dword)(((old >> 18) ^ old) >> 27);
+	dword rot = (dword)(old >> 59);
+	return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+}
+// [0, 1) with 24 bits of resolution, exact in a float
+inline float	CORE_Rand01(int stream = CORE_RAND_GAMEPLAY) { return (CORE_Rand32(stream) >> 8)
+				* (1.f / 16777216.f); }
+inline float	CORE_FRand(float from, float to, int stream = CORE_RAND_GAMEPLAY) { return from
+				+ (to - from) * CORE_Rand01(stream); }
+// [from, to] inclusive, multiply-shift range reduction instead of a modulo
+inline unsigned CORE_URand(unsigned from, unsigned to, int stream = CORE_RAND_GAMEPLAY) { return from
+				+ (unsigned)(((qword)CORE_Rand32(stream) * (qword)(to - from + 1)) >> 32); }
+inline bool		CORE_RandChance(float chance, int stream = CORE_RAND_GAMEPLAY) { return CORE_Rand01(stream)
+				< chance; }
 inline float	CORE_FSquare(float f) { return f * f; }
 
 //-----------------------------------------------------------------------------
@@ -28,14 +59,125 @@ inline rgba RGBA(float rr, float gg, float bb, float aa) { return MakeRGBA(rr/25
 static const rgba COLOR_WHITE = MakeRGBA(1.f, 1.f, 1.f, 1.f);
 
 //-----------------------------------------------------------------------------
-// Bitmap/texture functions
-int		CORE_LoadBmp(const char filename[], bool wrap);
+// Bitmap/texture functions. Texture indices are handles: once unloaded, an
+// index is of no texture, even after its slot gets a new one. Loading a file
+// (with the same 'wrap') again shares the texture, and each load wants its
+// own CORE_UnloadBmp(). Unless 'shared' is false: then it's a texture of its
+// own that later loads don't share either.
+int		CORE_LoadBmp(const char filename[], bool wrap, bool shared = true);
 ivec2	CORE_GetBmpSize(int texture_index);
 GLuint	CORE_GetBmpOpenGLTex(int texture_index);
 void	CORE_UnloadBmp(int texture_index);
 void	CORE_RenderCenteredSprite(vec2 pos, vec2 size, int texture_index, 
 			rgba color = COLOR_WHITE, bool additive = false);
 
+//-----------------------------------------------------------------------------
+// Asset archive: while one is open, CORE_LoadBmp() & CORE_LoadWav() (and the
+// Async ones) take files that are in it from there, already decoded. Cooking
+// one writes the given BMP & WAV files into it and returns how many went in,
+// -1 if it couldn't be written.
+bool	CORE_OpenArchive(const char filename[]);
+void	CORE_CloseArchive();
+int		CORE_CookArchive(const char filename[], const char *const names[], int num_names);
+
+//-----------------------------------------------------------------------------
+// Texture atlas: bitmaps loaded between these two calls without 'wrap' share
+// a few big textures, so sprites from any of them batch together. The page
+// textures only exist after CORE_EndAtlas(), which returns how many it made.
+// Pages are page_size square, 0 for the default (1024).
+void	CORE_BeginAtlas(int page_size = 0);
+int		CORE_EndAtlas();
+
+//-----------------------------------------------------------------------------
+// Render targets (GL 3.x, SYS_LoadGL33() first): a texture index that sprites
+// can also be drawn into. Between Begin and End, drawing goes to the target
+// with one unit per pixel and the origin at its bottom left corner. Release
+// with CORE_UnloadBmp(). Returns -1 if the driver won't make one.
+int		CORE_CreateRenderTarget(int pix_w, int pix_h);
+void	CORE_BeginRenderTarget(int texture_index);
+void	CORE_EndRenderTarget();
+
+//-----------------------------------------------------------------------------
+// GPU tilemaps (GL 3.3): a grid of cols x rows cells, each showing one of up
+// to 256 same-sized tiles, drawn with a single quad. The grid wraps around in
+// both directions. Tiles are copied from loaded textures, so the textures can
+// be unloaded afterwards. Create returns -1 if the driver isn't up to it.
+int		CORE_CreateTileMap(int cols, int rows, float tile_w, float tile_h);
+void	CORE_DestroyTileMap(int map);
+bool	CORE_SetTileMapTiles(int map, const int textures[], int num_textures);
+void	CORE_SetTileMapRow(int map, int row, const byte tiles[]);	// cols tile numbers
+// Fills the p0..p1 rect with the map, scrolled so p0 shows map point p0 + scroll
+void	CORE_RenderTileMap(int map, vec2 p0, vec2 p1, vec2 scroll);
+
+//-----------------------------------------------------------------------------
+// Sprite batching: the render functions above only queue quads. Consecutive
+// quads with the same texture go out in one draw call, so call
+// CORE_FlushSprites() before drawing with GL directly and before presenting.
+struct SpriteInstance
+{
+	vec2	pos;		// Center
+	vec2	size;
+	int		texture;	// CORE_LoadBmp() index
+	rgba	color;
+	bool	additive;
+};
+
+void	CORE_RenderSprites(const SpriteInstance sprites[], size_t n);
+void	CORE_FlushSprites();
+
+// Part of a texture on an axis aligned rect from p0 to p1. The UVs are 0..1
+// over the texture's own pixels, wherever it lives (atlas page, pow2 pad).
+void	CORE_RenderTexturedRect(vec2 p0, vec2 p1, int texture_index, vec2 uv0, vec2 uv1,
+			rgba color = COLOR_WHITE);
+
+//-----------------------------------------------------------------------------
+// GL state: core skips texture binds, blend changes etc. that wouldn't change
+// anything. If you change GL state behind its back, invalidate the cache.
+// The stats count the calls made & skipped since the previous Take.
+struct CORE_GLStats
+{
+	unsigned issued;
+	unsigned elided;
+};
+
+void	CORE_InvalidateGLState();
+CORE_GLStats CORE_TakeGLStats();
+
+//-----------------------------------------------------------------------------
+// View: the projection for everything drawn, with (0, 0) at the bottom left
+// of the window and (view_w, view_h) at the top right.
+void	CORE_SetView(float view_w, float view_h);
+
+//-----------------------------------------------------------------------------
+// Optional GL 3.3 sprite pipeline (SYS_LoadGL33() first): batches go out as
+// one instanced draw of a unit quad. If it fails, everything stays on the
+// fixed-function path.
+bool	CORE_InitInstancing();
+void	CORE_EndInstancing();
+bool	CORE_IsInstancing();
+
+//-----------------------------------------------------------------------------
+// Software renderer, for hosts without a GPU: sprites are rasterised on the
+// CPU into a pix_w x pix_h framebuffer by num_threads threads (0 for one per
+// core), the calling one included. Start it before loading textures, they
+// need CPU copies. Render targets & tilemaps aren't available with it on.
+// CORE_PresentSoft() draws the frame and shows it through GL, call it before
+// SYS_Show(). The dump is a .bmp of the last presented frame.
+bool	CORE_InitSoftRender(int pix_w, int pix_h, int num_threads);
+void	CORE_EndSoftRender();
+bool	CORE_IsSoftRender();
+void	CORE_PresentSoft();
+bool	CORE_DumpSoftFrame(const char filename[]);
+
+// Clears the screen (or the software framebuffer), use instead of glClear()
+void	CORE_Clear(rgba color);
+
+//-----------------------------------------------------------------------------
+// Bitmap font text (Kromasky layout: 8x8 grid of ASCII 32..95, uppercase only)
+// 'pos' is the top left corner of the first glyph, 'size' the glyph height.
+void	CORE_RenderText(vec2 pos, float size, const char text[], int font_texture,
+			rgba color = COLOR_WHITE);
+
 //-----------------------------------------------------------------------------
 // Sound
 bool CORE_InitSound();
@@ -47,4 +189,17 @@ void CORE_PlayLoopSound(size_t loop_channel, ALuint snd, float volume, float pit
 void CORE_SetLoopSoundParam(size_t loop_channel, float volume, float pitch);
 void CORE_StopLoopSound(size_t loop_channel);
 
+//-----------------------------------------------------------------------------
+// Asynchronous loading: between Start & Stop, the Async loads return a
+// texture index / AL buffer at once and num_threads threads (0 for one per
+// core) read & decode the files meanwhile. CORE_PumpAssets() uploads what's
+// ready and returns how many are still on the way, 'wait' blocks until at
+// least one more is in. Until then a texture is blank and a sound silent, as
+// they stay if the file can't be loaded. Stop finishes everything first.
+void	CORE_StartAssetLoader(int num_threads);
+void	CORE_StopAssetLoader();
+int		CORE_LoadBmpAsync(const char filename[], bool wrap);
+ALuint	CORE_LoadWavAsync(const char filename[]);
+int		CORE_PumpAssets(bool wait);
+
 #endif // !P7_CORE_H_
\ No newline at end of file
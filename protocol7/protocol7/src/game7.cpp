@@ -7,16 +7,17 @@
 #include "base.h"
 #include "sys.h"
 #include "core.h"
+#include "prof.h"
 
 //=============================================================================
-void Log(LPTSTR lpFormat, ...)
+void Log(const char lpFormat[], ...)
 {
-	TCHAR szBuf[1024];
+	char szBuf[1024];
 	va_list marker;
 
 	va_start(marker, lpFormat);
 	vsprintf(szBuf, lpFormat, marker);
-	OutputDebugString(szBuf);
+	SYS_Log(szBuf);
 	va_end(marker);
 }
 #define LOG(ALL_ARGS) Log ALL_ARGS
@@ -35,11 +36,13 @@ template <typename T>
 inline T Max(const T& a, const T& b) { return (a > b ? a : b); }
 template <typename T>
 inline T Min(const T& a, const T& b) { return (a < b ? a : b); }
+inline float Lerp(float a, float b, float t) { return a + (b - a) * t; }
 
 //=============================================================================
 // Game Parameter Constants
 
 // Sprites
+static const rgba  CLEAR_COLOR = MakeRGBA(0.f, .1f, .3f, 0.f);
 static const float SPRITE_SCALE = 8.f;
 static const float SHADOW_OFFSET = 80.f;
 static const float SHADOW_SCALE = 0.9f;
@@ -101,6 +104,11 @@ static const float RACE_END = 100000.f;
 static const float FPS = 60.f;
 static const float FRAMETIME = (1.f / FPS);
 
+// Main loop timing
+static const double SIM_STEP = (1.0 / FPS);
+static const int    MAX_SIM_STEPS_PER_FRAME = 5;	// Spiral-of-death protection
+static const double SIM_STEP_SNAP = .0002;		// Frame deltas this close to n steps are n steps
+
 static const float STARTING_TIME = 1.f;
 static const float DYING_TIME = 2.f;
 static const float VICTORY_TIME = 8.f;
@@ -117,6 +125,7 @@ vec2 g_last_conditioned = vmake(0.f, 0.f);
 
 float volatile g_current_race_pos = 0.f;
 float volatile g_camera_offset = 0.f;
+float g_prev_camera_offset = 0.f;	// Camera before the last tick, for render interpolation
 float g_rock_chance = START_ROCK_CHANCE_PER_PIXEL;
 float g_time_from_last_rocket = 0.f;
 
@@ -126,6 +135,15 @@ enum GameState { GS_START, GS_PLAYING, GS_DYING, GS_VICTORY };
 GameState g_gs = GS_START;
 float volatile g_gs_timer = 0.f;
 
+static const char *GS_NAMES[] = { "GS_START", "GS_PLAYING", "GS_DYING", "GS_VICTORY" };
+
+void SetGameState(GameState gs)
+{
+	g_gs = gs;
+	g_gs_timer = 0.f;
+	PROF_Marker(GS_NAMES[gs]);
+}
+
 //=============================================================================
 // Textures management
 enum TexId
@@ -407,20 +425,115 @@ TextureManager textures[] =
 	{"data/tiles/kb/bbbb.bmp"  , false, 0},
 };
 
+// Only queues them, the atlas stays open until LoadAssets() has them all.
+// Tiles load a tileset at a time when needed, see RequireTileset().
 void LoadTextures()
 {
-	for (size_t i = 0; i < ArraySize(textures); i++)
-		textures[i].tex = CORE_LoadBmp(textures[i].name, true);
+	PROF_ZONE("LoadTextures");
+	CORE_BeginAtlas();
+	for (size_t i = 0; i < T_TILES_G_ON_S; i++)
+		textures[i].tex = CORE_LoadBmpAsync(textures[i].name, textures[i].wrap);
 }
 
 void UnloadTextures()
 {
-	for (size_t i = 0; i < ArraySize(textures); i++)
+	for (size_t i = 0; i < T_TILES_G_ON_S; i++)
 		CORE_UnloadBmp(textures[i].tex);
 }
 
 inline GLuint Tex(TexId id) { return textures[id].tex; }
 
+//=============================================================================
+// Visibility culling. Sprites are centred on camera relative positions by the
+// time they are submitted, so the visible rect is just 0..G_WIDTH, 0..G_HEIGHT.
+struct CullStats
+{
+	unsigned entities, shadows, particles;
+};
+CullStats g_culled = { 0, 0, 0 };	// Render side: counted by the frame being drawn
+
+inline bool SpriteVisible(vec2 pos, vec2 size)
+{
+	return pos.x + .5f * size.x > 0.f && pos.x - .5f * size.x < G_WIDTH
+		&& pos.y + .5f * size.y > 0.f && pos.y - .5f * size.y < G_HEIGHT;
+}
+
+//=============================================================================
+// Render queue: sprites are recorded with a 64 bit sort key and drawn in key
+// order by FlushRenderQueue(). Layers keep the picture right (all shadows
+// under everything, ship over the rest...), and inside a layer sprites are
+// grouped by blend mode & GL texture, so batches only break between groups.
+// Depth orders the sprites of a group, and the queue index keeps it stable.
+//
+//   63..56 layer | 55 additive | 54..32 GL texture | 31..16 depth | 15..0 index
+enum RenderLayer { RL_SHADOWS, RL_OBJECTS, RL_SHIP, RL_PARTICLES };
+
+static const size_t MAX_RENDER_CMDS = 65536;	// Index must fit 16 bits
+
+SpriteInstance g_render_sprites[MAX_RENDER_CMDS];
+qword          g_render_keys[MAX_RENDER_CMDS];
+qword          g_render_scratch[MAX_RENDER_CMDS];
+size_t         g_num_render_cmds = 0;
+
+//-----------------------------------------------------------------------------
+void QueueSprite(RenderLayer layer, unsigned depth, vec2 pos, vec2 size, TexId tex, rgba color, bool additive)
+{
+	if (g_num_render_cmds == MAX_RENDER_CMDS)
+		return;
+
+	size_t index = g_num_render_cmds++;
+	SpriteInstance &sprite = g_render_sprites[index];
+	sprite.pos = pos;
+	sprite.size = size;
+	sprite.texture = Tex(tex);
+	sprite.color = color;
+	sprite.additive = additive;
+
+	g_render_keys[index] = (qword)layer << 56 | (qword)additive << 55
+		| (qword)(CORE_GetBmpOpenGLTex(sprite.texture) & 0x7FFFFF) << 32
+		| (qword)(depth & 0xFFFF) << 16 | index;
+}
+
+//-----------------------------------------------------------------------------
+// LSD radix sort, a byte at a time. Bytes that are the same in every key
+// (most of the high ones, usually) don't need a pass.
+void RadixSort(qword keys[], qword scratch[], size_t n)
+{
+	for (int shift = 0; shift < 64; shift += 8)
+	{
+		size_t count[256] = { 0 };
+		for (size_t i = 0; i < n; i++)
+			count[(keys[i] >> shift) & 0xFF]++;
+		if (count[(keys[0] >> shift) & 0xFF] == n)
+			continue;
+
+		size_t offset = 0;
+		for (int b = 0; b < 256; b++)
+		{
+			size_t c = count[b];
+			count[b] = offset;
+			offset += c;
+		}
+		for (size_t i = 0; i < n; i++)
+			scratch[count[(keys[i] >> shift) & 0xFF]++] = keys[i];
+		memcpy(keys, scratch, n * sizeof(keys[0]));
+	}
+}
+
+//-----------------------------------------------------------------------------
+void FlushRenderQueue()
+{
+	PROF_ZONE("FlushRenderQueue");
+	size_t n = g_num_render_cmds;
+	if (!n)
+		return;
+
+	RadixSort(g_render_keys, g_render_scratch, n);
+	for (size_t i = 0; i < n; i++)
+		CORE_RenderSprites(&g_render_sprites[g_render_keys[i] & 0xFFFF], 1);
+	g_num_render_cmds = 0;
+}
+
 //=============================================================================
 // Sound engine
 enum SoundId
@@ -447,8 +560,9 @@ Sound sounds[] =
 
 void LoadSounds()
 {
+	PROF_ZONE("LoadSounds");
 	for (size_t i = 0; i < ArraySize(sounds); i++)
-		sounds[i].buf_id = CORE_LoadWav(sounds[i].name);
+		sounds[i].buf_id = CORE_LoadWavAsync(sounds[i].name);
 }
 
 void UnloadSounds()
@@ -585,63 +699,38 @@ void SetPSystemSource(int index, vec2 pos, vec2 vel)
 }
 
 //-----------------------------------------------------------------------------
-void RenderPSystems(vec2 offset)
+// Particles are drawn 'alpha' of the way through their last tick: they moved by
+// vel - force during it, so no previous position needs to be stored.
+void RenderPSystems(const PSystem systems[], vec2 offset, float alpha)
 {
-	glEnable(GL_BLEND);
+	PROF_ZONE("RenderPSystems");
 	for (size_t i = 0; i < MAX_PSYSTEMS; i++)
 	{
-		if (psystems[i].type != PST_NULL)
+		if (systems[i].type != PST_NULL)
 		{
-			if (psdefs[psystems[i].type].additive)
-				glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-			else
-				glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-			glBindTexture(GL_TEXTURE_2D, CORE_GetBmpOpenGLTex(Tex(psdefs[psystems[i].type].texture)));
-			glBegin(GL_QUADS);
-
+			const PSDef &def = psdefs[systems[i].type];
 			for (size_t j = 0; j < MAX_PARTICLES; j++)
 			{
-				if (psystems[i].particles[j].active)
+				if (systems[i].particles[j].active)
 				{
-					vec2 pos = psystems[i].particles[j].pos;
-					float radius = psystems[i].particles[j].radius;
-					vec2 p0 = vsub(pos, vmake(radius, radius));
-					vec2 p1 = vadd(pos, vmake(radius, radius));
-					rgba color = psystems[i].particles[j].color;
-					float r = color.r;
-					float g = color.g;
-					float b = color.b;
-					float a = color.a;
-
-					glColor4f(r, g, b, a);
-
-					glTexCoord2d(0.0, 0.0);
-					glVertex2f(p0.x + offset.x, p0.y + offset.y);
-
-					glTexCoord2d(1.0, 0.0);
-					glVertex2f(p1.x + offset.x, p0.y + offset.y);
-
-					glTexCoord2d(1.0, 1.0);
-					glVertex2f(p1.x + offset.x, p1.y + offset.y);
-
-					glTexCoord2d(0.0, 1.0);
-					glVertex2f(p0.x + offset.x, p1.y + offset.y);
-
+					vec2 last_move = vsub(systems[i].particles[j].vel, def.force);
+					vec2 pos = vsub(systems[i].particles[j].pos, vscale(last_move, 1.f - alpha));
+					pos = vadd(pos, offset);
+					vec2 size = vmake(2.f * systems[i].particles[j].radius, 2.f * systems[i].particles[j].radius);
+					if (SpriteVisible(pos, size))
+						QueueSprite(RL_PARTICLES, 0, pos, size, def.texture, systems[i].particles[j].color, def.additive);
+					else
+						g_culled.particles++;
 				}
 			}
-
-			glEnd();
 		}
 	}
-
-	glColor4f(1.f, 1.f, 1.f, 1.);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 }
 
 //-----------------------------------------------------------------------------
 void RunPSystems()
 {
+	PROF_ZONE("RunPSystems");
 	for (size_t i = 0; i < MAX_PSYSTEMS; i++)
 	{
 		if (psystems[i].type != PST_NULL)
@@ -657,18 +746,18 @@ void RunPSystems()
 						psystems[i].particles[k].age = 0;
 						psystems[i].particles[k].pos =
 							vadd(psystems[i].source_pos,
-								vmake(CORE_FRand(-psdefs[psystems[i].type].start_pos_random, +psdefs[psystems[i].type].start_pos_random)
-								, CORE_FRand(-psdefs[psystems[i].type].start_pos_random, +psdefs[psystems[i].type].start_pos_random)
+								vmake(CORE_FRand(-psdefs[psystems[i].type].start_pos_random, +psdefs[psystems[i].type].start_pos_random, CORE_RAND_PARTICLES)
+								, CORE_FRand(-psdefs[psystems[i].type].start_pos_random, +psdefs[psystems[i].type].start_pos_random, CORE_RAND_PARTICLES)
 							)
 							);
 						psystems[i].particles[k].vel =
 							vadd(psystems[i].source_vel,
 								vmake(
-								psdefs[psystems[i].type].start_speed_fixed.x + CORE_FRand(-psdefs[psystems[i].type].start_speed_random, +psdefs[psystems[i].type].start_speed_random),
-								psdefs[psystems[i].type].start_speed_fixed.y + CORE_FRand(-psdefs[psystems[i].type].start_speed_random, +psdefs[psystems[i].type].start_speed_random)
+								psdefs[psystems[i].type].start_speed_fixed.x + CORE_FRand(-psdefs[psystems[i].type].start_speed_random, +psdefs[psystems[i].type].start_speed_random, CORE_RAND_PARTICLES),
+								psdefs[psystems[i].type].start_speed_fixed.y + CORE_FRand(-psdefs[psystems[i].type].start_speed_random, +psdefs[psystems[i].type].start_speed_random, CORE_RAND_PARTICLES)
 							)
 							);
-						psystems[i].particles[k].radius = CORE_FRand(psdefs[psystems[i].type].start_radius_min, psdefs[psystems[i].type].startradius_max);
+						psystems[i].particles[k].radius = CORE_FRand(psdefs[psystems[i].type].start_radius_min, psdefs[psystems[i].type].startradius_max, CORE_RAND_PARTICLES);
 						psystems[i].particles[k].color = psdefs[psystems[i].type].start_color_fixed;
 						break;
 					}
@@ -755,6 +844,7 @@ int g_last_generated = -1;
 
 void GenTerrain(float upto)
 {
+	PROF_ZONE("GenTerrain");
 	int last_required_row = 1 + (int)(upto / TILE_HEIGHT);
 
 	// Generate random terrain types
@@ -767,8 +857,10 @@ void GenTerrain(float upto)
 
 		int mapped_row = UMod(i, RUNNING_ROWS);
 
+		float rolls[TILES_ACROSS];
+		CORE_FRandFill(rolls, TILES_ACROSS, 0.f, 1.f, CORE_RAND_TERRAIN);
 		for (int j = 0; j < TILES_ACROSS; j++)
-			Terrain[mapped_row][j] = (CORE_RandChance(chance) & 1);
+			Terrain[mapped_row][j] = (rolls[j] < chance);
 	}
 
 	// Calculate the tiles
@@ -791,20 +883,336 @@ void GenTerrain(float upto)
 }
 
 //-----------------------------------------------------------------------------
-void RenderTerrain()
+// Terrain cache (GL 3.x), of one of two kinds. By default ring rows are drawn
+// once, one texel per tile texel, into a render target laid out like TileMap,
+// and RenderTerrain composites the visible part with one quad (two where it
+// wraps around the ring). With -tilemap, TileMap goes to a GPU tilemap as
+// tile numbers within the active tileset, and the terrain is a single quad.
+// Either way, only rows a snapshot brings that the cache hasn't seen yet are
+// updated.
+struct TerrainCache
+{
+	int   target = -1;			// CORE render target, or -1
+	int   tilemap = -1;			// CORE tilemap, or -1
+	TexId tileset = T_FONT;		// First tile of the set in the tilemap, T_FONT if none
+	int   tile_w = 0, tile_h = 0;	// Tile bitmap size, one cell of the ring target
+	bool  valid[RUNNING_ROWS] = {};
+	TexId rows[RUNNING_ROWS][TILES_ACROSS] = {};
+};
+
+TerrainCache g_terrain_cache;
+
+void InitTerrainCache(bool gpu_tilemap)
 {
-	int first_row = (int)(g_camera_offset / TILE_HEIGHT);
+	TerrainCache &tc = g_terrain_cache;
+	memset(tc.valid, 0, sizeof(tc.valid));
 
+	if (gpu_tilemap)
+	{
+		tc.tilemap = CORE_CreateTileMap(TILES_ACROSS, RUNNING_ROWS, TILE_WIDTH, TILE_HEIGHT);
+		if (tc.tilemap >= 0)
+			return;
+	}
+
+	// The ring only works if every tile has the same size. These are the
+	// active tileset's, ones loaded later are checked by EndTilesetLoad().
+	ivec2 size = CORE_GetBmpSize(Tex(g_active_tileset));
+	for (int i = g_active_tileset; i < g_active_tileset + 16; i++)
+	{
+		ivec2 s = CORE_GetBmpSize(Tex((TexId)i));
+		if (s.x != size.x || s.y != size.y)
+			return;
+	}
+
+	tc.tile_w = size.x;
+	tc.tile_h = size.y;
+	tc.target = CORE_CreateRenderTarget(TILES_ACROSS * tc.tile_w, RUNNING_ROWS * tc.tile_h);
+}
+
+void EndTerrainCache()
+{
+	if (g_terrain_cache.target >= 0)
+		CORE_UnloadBmp(g_terrain_cache.target);
+	if (g_terrain_cache.tilemap >= 0)
+		CORE_DestroyTileMap(g_terrain_cache.tilemap);
+	g_terrain_cache.target = -1;
+	g_terrain_cache.tilemap = -1;
+}
+
+// Brings the cached rows from first_row on up to date with the snapshot.
+// False if the tilemap can't show them, so they go as sprites: rows from two
+// tilesets, or a set whose tiles differ in size, which drops the tilemap for
+// good (the ring target couldn't take those either).
+bool UpdateTerrainCache(const TexId tilemap[RUNNING_ROWS][TILES_ACROSS], int first_row, int num_rows)
+{
+	TerrainCache &tc = g_terrain_cache;
+
+	// The tilemap holds one tileset, the one of the rows on screen
+	TexId tileset = tc.tileset;
+	if (tc.tilemap >= 0)
+	{
+		tileset = (TexId)(T_TILES_G_ON_S + (tilemap[UMod(first_row, RUNNING_ROWS)][0] - T_TILES_G_ON_S) / 16 * 16);
+		for (int i = first_row; i < first_row + num_rows; i++)
+			for (int j = 0; j < TILES_ACROSS; j++)
+			{
+				TexId tile = tilemap[UMod(i, RUNNING_ROWS)][j];
+				if (tile < tileset || tile >= tileset + 16)
+					return false;
+			}
+
+		if (tileset != tc.tileset)
+		{
+			int tiles[16];
+			for (int i = 0; i < 16; i++)
+				tiles[i] = Tex((TexId)(tileset + i));
+			if (!CORE_SetTileMapTiles(tc.tilemap, tiles, 16))
+			{
+				LOG(("Tileset %d won't go in the GPU tilemap, dropping it\n", (tileset - T_TILES_G_ON_S) / 16));
+				CORE_DestroyTileMap(tc.tilemap);
+				tc.tilemap = -1;
+				return false;
+			}
+			tc.tileset = tileset;
+			memset(tc.valid, 0, sizeof(tc.valid));
+		}
+	}
+
+	bool drawing = false;
+	for (int i = first_row; i < first_row + num_rows; i++)
+	{
+		int mapped_row = UMod(i, RUNNING_ROWS);
+		if (tc.valid[mapped_row] && !memcmp(tc.rows[mapped_row], tilemap[mapped_row], sizeof(tc.rows[mapped_row])))
+			continue;
+
+		if (tc.tilemap >= 0)
+		{
+			byte cells[TILES_ACROSS];
+			for (int j = 0; j < TILES_ACROSS; j++)
+				cells[j] = (byte)((tilemap[mapped_row][j] - tileset) & 15);
+			CORE_SetTileMapRow(tc.tilemap, mapped_row, cells);
+		}
+		else
+		{
+			if (!drawing)
+			{
+				CORE_BeginRenderTarget(tc.target);
+				drawing = true;
+			}
+			for (int j = 0; j < TILES_ACROSS; j++)
+				CORE_RenderCenteredSprite(vmake((j + .5f) * tc.tile_w, (mapped_row + .5f) * tc.tile_h),
+					vmake((float)tc.tile_w, (float)tc.tile_h), Tex(tilemap[mapped_row][j]));
+		}
+		memcpy(tc.rows[mapped_row], tilemap[mapped_row], sizeof(tc.rows[mapped_row]));
+		tc.valid[mapped_row] = true;
+	}
+	if (drawing)
+		CORE_EndRenderTarget();
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+void RenderTerrain(const TexId tilemap[RUNNING_ROWS][TILES_ACROSS], float camera_offset)
+{
+	PROF_ZONE("RenderTerrain");
+	int first_row = (int)(camera_offset / TILE_HEIGHT);
+
+	const TerrainCache &tc = g_terrain_cache;
+	if (tc.tilemap >= 0 && UpdateTerrainCache(tilemap, first_row, TILES_DOWN))
+	{
+		CORE_RenderTileMap(tc.tilemap, vmake(0.f, 0.f), vmake((float)G_WIDTH, (float)G_HEIGHT), vmake(0.f, camera_offset));
+		return;
+	}
+	if (tc.target >= 0)
+	{
+		UpdateTerrainCache(tilemap, first_row, TILES_DOWN);
+
+		// The screen in ring texels, from the bottom
+		float ring_w = (float)(TILES_ACROSS * tc.tile_w), ring_h = (float)(RUNNING_ROWS * tc.tile_h);
+		float w = G_WIDTH * tc.tile_w / (float)TILE_WIDTH;
+		float h = G_HEIGHT * tc.tile_h / (float)TILE_HEIGHT;
+		float y0 = camera_offset * tc.tile_h / TILE_HEIGHT;
+		y0 -= floorf(y0 / ring_h) * ring_h;
+
+		int ring = tc.target;
+		if (y0 + h <= ring_h)
+			CORE_RenderTexturedRect(vmake(0.f, 0.f), vmake((float)G_WIDTH, (float)G_HEIGHT), ring,
+				vmake(0.f, y0 / ring_h), vmake(w / ring_w, (y0 + h) / ring_h));
+		else
+		{
+			float split = (ring_h - y0) / h * G_HEIGHT;
+			CORE_RenderTexturedRect(vmake(0.f, 0.f), vmake((float)G_WIDTH, split), ring,
+				vmake(0.f, y0 / ring_h), vmake(w / ring_w, 1.f));
+			CORE_RenderTexturedRect(vmake(0.f, split), vmake((float)G_WIDTH, (float)G_HEIGHT), ring,
+				vmake(0.f, 0.f), vmake(w / ring_w, (y0 + h - ring_h) / ring_h));
+		}
+		return;
+	}
+
+	SpriteInstance tiles[TILES_DOWN * TILES_ACROSS];
+	size_t num_tiles = 0;
 	for (int i = first_row; i < first_row + TILES_DOWN; i++)
 	{
 		int mapped_row = UMod(i, RUNNING_ROWS);
 		for (int j = 0; j < TILES_ACROSS; j++)
-			CORE_RenderCenteredSprite(
-				vsub(vmake(j * TILE_WIDTH + .5f * TILE_WIDTH, i * TILE_HEIGHT + .5f * TILE_HEIGHT), vmake(0.f, g_camera_offset)),
-				vmake(TILE_WIDTH * 1.01f, TILE_HEIGHT * 1.01f),
-				Tex(TileMap[mapped_row][j])
-			);
+		{
+			SpriteInstance &tile = tiles[num_tiles++];
+			tile.pos = vmake(j * TILE_WIDTH + .5f * TILE_WIDTH, i * TILE_HEIGHT + .5f * TILE_HEIGHT - camera_offset);
+			tile.size = vmake(TILE_WIDTH * 1.01f, TILE_HEIGHT * 1.01f);
+			tile.texture = Tex(tilemap[mapped_row][j]);
+			tile.color = COLOR_WHITE;
+			tile.additive = false;
+		}
 	}
+	CORE_RenderSprites(tiles, num_tiles);
+}
+
+//-----------------------------------------------------------------------------
+// Tileset residency: only tilesets on screen are loaded, plus the next
+// level's, prefetched on the loader threads during GS_VICTORY. Each set gets
+// a small atlas page of its own, and the least recently seen sets are
+// unloaded while the resident ones are over TILESET_BUDGET. GL thread only.
+static const int    NUM_TILESETS = (T_BBBB + 1 - T_TILES_G_ON_S) / 16;
+static const int    TILESET_ATLAS_SIZE = 128;			// 16 24x28 tiles & borders
+static const size_t TILESET_PAGE_BYTES = (size_t)TILESET_ATLAS_SIZE * TILESET_ATLAS_SIZE * 4;
+static const size_t TILESET_BUDGET = 2 * TILESET_PAGE_BYTES;	// Texture bytes, two sets
+
+struct Tileset
+{
+	bool     resident;
+	unsigned last_seen;		// g_tileset_frame it was last on screen
+	size_t   bytes;
+};
+
+Tileset  g_tilesets[NUM_TILESETS];
+int      g_tileset_loading = -1;	// Set in the loader, -1 if none
+unsigned g_tileset_frame = 0;
+
+inline int   TilesetOf(TexId tile) { return (tile - T_TILES_G_ON_S) / 16; }
+inline TexId FirstTile(int set) { return (TexId)(T_TILES_G_ON_S + set * 16); }
+
+void BeginTilesetLoad(int set)
+{
+	CORE_BeginAtlas(TILESET_ATLAS_SIZE);
+	for (int i = FirstTile(set); i < FirstTile(set) + 16; i++)
+		textures[i].tex = CORE_LoadBmpAsync(textures[i].name, textures[i].wrap);
+	g_tilesets[set].last_seen = g_tileset_frame;
+	g_tileset_loading = set;
+}
+
+void UnloadTileset(int set)
+{
+	for (int i = FirstTile(set); i < FirstTile(set) + 16; i++)
+	{
+		CORE_UnloadBmp(textures[i].tex);
+		textures[i].tex = (GLuint)-1;	// Its slot may go to another texture
+	}
+	g_tilesets[set].resident = false;
+}
+
+// Call once CORE_PumpAssets() has nothing left
+void EndTilesetLoad()
+{
+	int set = g_tileset_loading;
+	int pages = CORE_EndAtlas();
+	g_tileset_loading = -1;
+
+	// What the set takes on the GPU: its page, plus a texture, a power of 2
+	// each way, for any tile too big for the page
+	Tileset &ts = g_tilesets[set];
+	ts.resident = true;
+	ts.bytes = pages * TILESET_PAGE_BYTES;
+	TerrainCache &tc = g_terrain_cache;
+	for (int i = FirstTile(set); i < FirstTile(set) + 16; i++)
+	{
+		ivec2 size = CORE_GetBmpSize(Tex((TexId)i));
+		if (size.x + 2 > TILESET_ATLAS_SIZE || size.y + 2 > TILESET_ATLAS_SIZE)
+		{
+			size_t w = 1, h = 1;
+			while (w < (size_t)size.x) w *= 2;
+			while (h < (size_t)size.y) h *= 2;
+			ts.bytes += w * h * 4;
+		}
+		if (tc.target >= 0 && (size.x != tc.tile_w || size.y != tc.tile_h))
+		{
+			CORE_UnloadBmp(tc.target);	// Tiles the ring can't hold, draw them as sprites
+			tc.target = -1;
+		}
+	}
+
+	// Over budget: drop the least recently seen sets, never one on screen
+	for (;;)
+	{
+		size_t bytes = 0;
+		int lru = -1;
+		for (int i = 0; i < NUM_TILESETS; i++)
+		{
+			if (!g_tilesets[i].resident)
+				continue;
+			bytes += g_tilesets[i].bytes;
+			if (i != set && g_tilesets[i].last_seen != g_tileset_frame
+				&& (lru < 0 || g_tilesets[i].last_seen < g_tilesets[lru].last_seen))
+				lru = i;
+		}
+		if (bytes <= TILESET_BUDGET || lru < 0)
+			break;
+		UnloadTileset(lru);
+	}
+}
+
+// Loads a set now, finishing a prefetch first if one is on
+void RequireTileset(int set)
+{
+	if (g_tilesets[set].resident)
+		return;
+	PROF_ZONE("RequireTileset");
+	if (g_tileset_loading >= 0 && g_tileset_loading != set)
+	{
+		while (CORE_PumpAssets(true))
+			;
+		EndTilesetLoad();
+	}
+	if (g_tileset_loading < 0)
+		BeginTilesetLoad(set);
+	while (CORE_PumpAssets(true))
+		;
+	EndTilesetLoad();
+}
+
+// Before drawing the terrain: makes sure what's on screen is in & prefetches
+void UpdateTilesets(const TexId tilemap[RUNNING_ROWS][TILES_ACROSS], float camera_offset, int next_set)
+{
+	PROF_ZONE("UpdateTilesets");
+	g_tileset_frame++;
+
+	bool on_screen[NUM_TILESETS] = {false};
+	int first_row = (int)(camera_offset / TILE_HEIGHT);
+	for (int i = first_row; i < first_row + TILES_DOWN; i++)
+		for (int j = 0; j < TILES_ACROSS; j++)
+			on_screen[TilesetOf(tilemap[UMod(i, RUNNING_ROWS)][j])] = true;
+	for (int i = 0; i < NUM_TILESETS; i++)
+		if (on_screen[i])
+			g_tilesets[i].last_seen = g_tileset_frame;
+	for (int i = 0; i < NUM_TILESETS; i++)
+		if (on_screen[i])
+			RequireTileset(i);
+
+	if (next_set >= 0 && !g_tilesets[next_set].resident && g_tileset_loading < 0)
+		BeginTilesetLoad(next_set);
+	if (g_tileset_loading >= 0 && !CORE_PumpAssets(false))
+		EndTilesetLoad();
+}
+
+void UnloadTilesets()
+{
+	if (g_tileset_loading >= 0)
+	{
+		while (CORE_PumpAssets(true))
+			;
+		EndTilesetLoad();
+	}
+	for (int i = 0; i < NUM_TILESETS; i++)
+		if (g_tilesets[i].resident)
+			UnloadTileset(i);
 }
 
 //=============================================================================
@@ -816,6 +1224,7 @@ struct Entity
 {
 	EType	type;
 	vec2	pos;
+	vec2	prev_pos;	// Before the last tick, for render interpolation
 	vec2	vel;
 	float	radius;
 	float	energy;
@@ -842,6 +1251,7 @@ int InsertEntity(EType type, vec2 pos, vec2 vel, float radius, TexId tex,
 		{
 			g_entities[i].type = type;
 			g_entities[i].pos = pos;
+			g_entities[i].prev_pos = pos;
 			g_entities[i].vel = vel;
 			g_entities[i].radius = radius;
 			g_entities[i].energy = MAX_ENERGY;
@@ -875,6 +1285,7 @@ void KillEntity(int index)
 // Generate the level obstacles
 void GenNextElements()
 {
+	PROF_ZONE("GenNextElements");
 	// Called every game loop, but only does work when we are close to the next "challenge area"
 	if (g_current_race_pos + G_HEIGHT > g_next_challenge_area)
 	{
@@ -896,7 +1307,7 @@ void GenNextElements()
 		LOG(("Current: %f\n", g_next_challenge_area));
 
 		// Choose how many layers of rocks
-		size_t nlayers = (int)CORE_URand(1, 20);
+		size_t nlayers = (int)CORE_URand(1, 20, CORE_RAND_LEVEL);
 		LOG((" nlayers: %d\n", nlayers));
 		for (size_t i = 0; i < nlayers; i++)
 		{
@@ -909,10 +1320,10 @@ void GenNextElements()
 			bracket_left = Max(bracket_left, 2.f * MAINSHIP_RADIUS);
 			bracket_right = Max(bracket_right, G_WIDTH - 2.f * MAINSHIP_RADIUS);
 			g_last_conditioned.y = current_y;
-			g_last_conditioned.x = CORE_FRand(bracket_left, bracket_right);
+			g_last_conditioned.x = CORE_FRand(bracket_left, bracket_right, CORE_RAND_LEVEL);
 
 			// Choose how many rocks
-			size_t nrocks = (int)CORE_URand(1, 2);
+			size_t nrocks = (int)CORE_URand(1, 2, CORE_RAND_LEVEL);
 			LOG(("  nrocks: %d\n", nrocks));
 
 			// Gen rocks
@@ -922,7 +1333,7 @@ void GenNextElements()
 				vec2 rock_pos;
 				while (true)
 				{
-					rock_pos = vmake(CORE_FRand(0.f, G_WIDTH), current_y);
+					rock_pos = vmake(CORE_FRand(0.f, G_WIDTH, CORE_RAND_LEVEL), current_y);
 					if (rock_pos.x + ROCK_RADIUS < g_last_conditioned.x - path_width ||
 						rock_pos.x - ROCK_RADIUS > g_last_conditioned.x + path_width)
 						break;
@@ -931,81 +1342,157 @@ void GenNextElements()
 				// Insert obstacle
 				EType t = E_ROCK;
 				TexId tex = T_ROCK1;
-				if (CORE_RandChance(0.1f)) { t = E_MINE;  tex = T_MINE; }
-				else if (CORE_RandChance(0.1f)) { t = E_DRONE; tex = T_DRONE2; }
+				if (CORE_RandChance(0.1f, CORE_RAND_LEVEL)) { t = E_MINE;  tex = T_MINE; }
+				else if (CORE_RandChance(0.1f, CORE_RAND_LEVEL)) { t = E_DRONE; tex = T_DRONE2; }
 
-				InsertEntity(t, rock_pos, vmake(CORE_FRand(-.5f, +.5f), CORE_FRand(-.5f, +.5f)),
+				InsertEntity(t, rock_pos, vmake(CORE_FRand(-.5f, +.5f, CORE_RAND_LEVEL), CORE_FRand(-.5f, +.5f, CORE_RAND_LEVEL)),
 					ROCK_RADIUS, tex, true);
 			}
 
-			current_y += CORE_FRand(300.f, 600.f);
+			current_y += CORE_FRand(300.f, 600.f, CORE_RAND_LEVEL);
 		}
 
-		g_next_challenge_area = current_y + CORE_FRand(.5f * G_HEIGHT, 1.5f * G_HEIGHT);
+		g_next_challenge_area = current_y + CORE_FRand(.5f * G_HEIGHT, 1.5f * G_HEIGHT, CORE_RAND_LEVEL);
 		LOG(("Next: %f\n\n", g_next_challenge_area));
 	}
 }
 
+//=============================================================================
+// World snapshots - What the renderer sees of the simulation
+struct WorldSnapshot
+{
+	Entity    entities[MAX_ENTITIES];
+	PSystem   psystems[MAX_PSYSTEMS];	// Particles only copied for systems in use
+	TexId     tilemap[RUNNING_ROWS][TILES_ACROSS];
+	float     camera_offset;
+	float     prev_camera_offset;
+	float     race_pos;
+	GameState gs;
+	int       next_tileset;	// Worth prefetching, -1 if none
+	double    time;		// SYS_GetTime() at which the last tick was due
+};
+
+// Triple buffer: the sim writes one slot, the renderer reads another and the
+// third is handed over through an atomic exchange, so neither side waits.
+static const int SNAP_INDEX_MASK = 3;
+static const int SNAP_NEW = 4;
+WorldSnapshot    g_snapshots[3];
+int              g_snap_write = 0;				// Sim thread only
+int              g_snap_read = 1;				// Render thread only
+std::atomic<int> g_snap_ready(2);				// Hand-off slot | SNAP_NEW
+
 //-----------------------------------------------------------------------------
-void Render()
+void PublishSnapshot(double time)
 {
-	glClear(GL_COLOR_BUFFER_BIT);
+	WorldSnapshot *snap = &g_snapshots[g_snap_write];
 
-	// Generate terrain as necessary for rendering next!
-	GenTerrain(g_camera_offset + G_HEIGHT);
-	RenderTerrain();
+	memcpy(snap->entities, g_entities, sizeof(g_entities));
+	for (size_t i = 0; i < MAX_PSYSTEMS; i++)
+	{
+		snap->psystems[i].type = psystems[i].type;
+		if (psystems[i].type != PST_NULL)
+			memcpy(snap->psystems[i].particles, psystems[i].particles, sizeof(psystems[i].particles));
+	}
+	memcpy(snap->tilemap, TileMap, sizeof(TileMap));
+	snap->camera_offset = g_camera_offset;
+	snap->prev_camera_offset = g_prev_camera_offset;
+	snap->race_pos = g_current_race_pos;
+	snap->gs = g_gs;
+	snap->next_tileset = (g_gs == GS_VICTORY && g_current_level + 1 < (int)NUM_LEVELS)
+		? TilesetOf(LevelDescs[g_current_level + 1].tileset) : -1;
+	snap->time = time;
+
+	g_snap_write = g_snap_ready.exchange(g_snap_write | SNAP_NEW) & SNAP_INDEX_MASK;
+}
 
-	// Draw entities (Reverse order to draw ship on top always)
+//-----------------------------------------------------------------------------
+// Newest published snapshot (or the one we already had if nothing new)
+const WorldSnapshot *AcquireSnapshot()
+{
+	if (g_snap_ready.load() & SNAP_NEW)
+		g_snap_read = g_snap_ready.exchange(g_snap_read) & SNAP_INDEX_MASK;
+	return &g_snapshots[g_snap_read];
+}
+
+//-----------------------------------------------------------------------------
+// Draws the snapshot 'alpha' (0..1) of the way from the previous tick to its
+// own, so rendering can run at any rate while the sim stays at FPS.
+void Render(const WorldSnapshot &snap, float alpha)
+{
+	PROF_ZONE("Render");
+	CORE_Clear(CLEAR_COLOR);
+
+	float camera_offset = Lerp(snap.prev_camera_offset, snap.camera_offset, alpha);
+	UpdateTilesets(snap.tilemap, camera_offset, snap.next_tileset);
+	RenderTerrain(snap.tilemap, camera_offset);
+	memset(&g_culled, 0, sizeof(g_culled));
+
+	// Queue entities, in reverse order like they always were drawn (ship last)
 	for (int i = MAX_ENTITIES - 1; i >= 0; i--)
 	{
-		if (g_entities[i].type != E_NULL)
+		const Entity &e = snap.entities[i];
+		if (e.type != E_NULL)
 		{
-			ivec2 size = CORE_GetBmpSize(Tex(g_entities[i].texture));
-			vec2 pos = g_entities[i].pos;
+			unsigned depth = MAX_ENTITIES - 1 - i;
+			ivec2 bmp_size = CORE_GetBmpSize(Tex(e.texture));
+			vec2 size = vmake(bmp_size.x * SPRITE_SCALE * e.tex_scale, bmp_size.y * SPRITE_SCALE * e.tex_scale);
+			vec2 pos = vlerp(e.prev_pos, e.pos, alpha);
 			pos.x = (float)((int)pos.x);
-			pos.y = (float)((int)pos.y);
-
-			// Draw shadow first if valid
-			if (g_entities[i].has_shadow)
-				CORE_RenderCenteredSprite(vadd(vsub(pos, vmake(0.f, g_camera_offset)),
-					vmake(0.f, -SHADOW_OFFSET)), vmake(size.x * SPRITE_SCALE * g_entities[i].tex_scale
-					* SHADOW_SCALE, size.y * SPRITE_SCALE * g_entities[i].tex_scale * SHADOW_SCALE),
-					Tex(g_entities[i].texture), MakeRGBA(0.f, 0.f, 0.f, 0.4f), g_entities[i].tex_additive);
-
-			// Draw actual entity
-			CORE_RenderCenteredSprite(vsub(pos, vmake(0.f, g_camera_offset)),
-				vmake(size.x * SPRITE_SCALE * g_entities[i].tex_scale, size.y * SPRITE_SCALE * g_entities[i].tex_scale), Tex(g_entities[i].texture), g_entities[i].color, g_entities[i].tex_additive);
+			pos.y = (float)((int)pos.y) - camera_offset;
+
+			// Shadow if it has one, drawn under everything by its layer
+			if (e.has_shadow)
+			{
+				vec2 shadow_pos = vadd(pos, vmake(0.f, -SHADOW_OFFSET));
+				vec2 shadow_size = vscale(size, SHADOW_SCALE);
+				if (SpriteVisible(shadow_pos, shadow_size))
+					QueueSprite(RL_SHADOWS, depth, shadow_pos, shadow_size,
+						e.texture, MakeRGBA(0.f, 0.f, 0.f, 0.4f), e.tex_additive);
+				else
+					g_culled.shadows++;
+			}
+
+			// Actual entity
+			if (SpriteVisible(pos, size))
+				QueueSprite(i == MAINSHIP_ENTITY ? RL_SHIP : RL_OBJECTS, depth, pos, size, e.texture, e.color, e.tex_additive);
+			else
+				g_culled.entities++;
 		}
 	}
 
 	// Particle Systems
-	RenderPSystems(vmake(0.f, -g_camera_offset));
+	RenderPSystems(snap.psystems, vmake(0.f, -camera_offset), alpha);
+	FlushRenderQueue();
 
 	// Draw the UI
-	if (g_gs != GS_VICTORY)
+	if (snap.gs != GS_VICTORY)
 	{
+		const Entity *main_ship = &snap.entities[MAINSHIP_ENTITY];
+
 		// Energy bar
-		float energy_ratio = MAIN_SHIP->energy / MAX_ENERGY;
+		float energy_ratio = main_ship->energy / MAX_ENERGY;
 		CORE_RenderCenteredSprite(
 			vmake(ENERGY_BAR_W / 2.f, energy_ratio * ENERGY_BAR_H / 2.f),
 			vmake(ENERGY_BAR_W, ENERGY_BAR_H * energy_ratio),
 			Tex(T_ENERGY), COLOR_WHITE, true);
 
 		// Fuel bar
-		float fuel_ratio = MAIN_SHIP->fuel / MAX_FUEL;
+		float fuel_ratio = main_ship->fuel / MAX_FUEL;
 		CORE_RenderCenteredSprite(
 			vmake(G_WIDTH - FUEL_BAR_W / 2.f, fuel_ratio * FUEL_BAR_H / 2.f),
 			vmake(FUEL_BAR_W, FUEL_BAR_H * fuel_ratio),
 			Tex(T_FUEL), COLOR_WHITE, true);
 
 		// Pearl
-		int num_chunks = (int)((g_current_race_pos / RACE_END) * MAX_CHUNKS);
+		int num_chunks = (int)((snap.race_pos / RACE_END) * MAX_CHUNKS);
 		for (int i = 0; i < num_chunks; i++)
 			CORE_RenderCenteredSprite(
 				vmake(G_WIDTH - 100.f, 50.f + i * 50.f),
 				vmake(CHUNK_W, CHUNK_H),
 				Tex(T_PEARL));
 	}
+
+	CORE_FlushSprites();
 }
 
 //-----------------------------------------------------------------------------
@@ -1021,9 +1508,9 @@ void ResetNewGame(int level)
 	g_last_conditioned = vmake(.5f * G_WIDTH, 0.f);
 	g_current_race_pos = 0.f;
 	g_camera_offset = 0.f;
+	g_prev_camera_offset = 0.f;
 	g_rock_chance = START_ROCK_CHANCE_PER_PIXEL;
-	g_gs = GS_START;
-	g_gs_timer = 0.f;
+	SetGameState(GS_START);
 	g_last_generated = -1;
 
 	// Start logic
@@ -1044,6 +1531,12 @@ void ResetNewGame(int level)
 //-----------------------------------------------------------------------------
 void RunGame()
 {
+	PROF_ZONE("RunGame");
+	// Remember where things were, the renderer interpolates from there
+	g_prev_camera_offset = g_camera_offset;
+	for (size_t i = 0; i < MAX_ENTITIES; i++)
+		g_entities[i].prev_pos = g_entities[i].pos;
+
 	// Control main ship
 	if (g_gs == GS_PLAYING || g_gs == GS_VICTORY)
 	{
@@ -1205,8 +1698,7 @@ void RunGame()
 	{
 		if (g_current_race_pos >= RACE_END)
 		{
-			g_gs = GS_VICTORY;
-			g_gs_timer = 0.f;
+			SetGameState(GS_VICTORY);
 			MAIN_SHIP->tex_additive = true;
 			PlaySound(SND_SUCCESS);
 		}
@@ -1219,8 +1711,7 @@ void RunGame()
 	case GS_START:
 		if (g_gs_timer >= STARTING_TIME)
 		{
-			g_gs = GS_PLAYING;
-			g_gs_timer = 0.f;
+			SetGameState(GS_PLAYING);
 		}
 		break;
 
@@ -1234,8 +1725,7 @@ void RunGame()
 	case GS_PLAYING:
 		if (MAIN_SHIP->energy <= 0.f || MAIN_SHIP->fuel <= 0.f)
 		{
-			g_gs = GS_DYING;
-			g_gs_timer = 0.f;
+			SetGameState(GS_DYING);
 			MAIN_SHIP->texture = T_SHIP_RR;
 		}
 		break;
@@ -1252,14 +1742,80 @@ void RunGame()
 	}
 
 	g_time_from_last_rocket += FRAMETIME;
+
+	// Generate terrain as necessary for rendering next!
+	GenTerrain(g_camera_offset + G_HEIGHT);
 }
 
 //-----------------------------------------------------------------------------
-void ProcessInput()
+// Input seen by the sim. Edges from the platform snapshot pile up here until a
+// tick consumes them, so a tap is never lost on a frame that runs no ticks.
+SYS_InputState g_input;
+
+void GatherInput()
+{
+	const SYS_InputState &in = SYS_GetInput();
+	for (int k = 0; k < SYS_MAX_KEYS; k++)
+	{
+		g_input.down[k] = in.down[k];
+		g_input.pressed[k] = (byte)Min(g_input.pressed[k] + in.pressed[k], 0xFF);
+		g_input.released[k] = (byte)Min(g_input.released[k] + in.released[k], 0xFF);
+		if (in.pressed[k] || in.released[k])
+			g_input.event_time[k] = in.event_time[k];
+	}
+	g_input.mouse = in.mouse;
+	g_input.time = in.time;
+}
+
+void ConsumeInputEdges()
+{
+	memset(g_input.pressed, 0, sizeof(g_input.pressed));
+	memset(g_input.released, 0, sizeof(g_input.released));
+}
+
+// A tap shorter than a tick still counts as held for that tick
+inline bool KeyDown(int key) { return g_input.down[key] || g_input.pressed[key]; }
+inline bool KeyHit(int key)  { return g_input.pressed[key] != 0; }
+
+//-----------------------------------------------------------------------------
+// Everything ProcessInput looks at, packed in one word per tick. Replays store
+// exactly this, so any new input that steers the sim has to go in here too.
+enum
+{
+	IN_UP          = 1 << 0,
+	IN_DOWN        = 1 << 1,
+	IN_LEFT        = 1 << 2,
+	IN_RIGHT       = 1 << 3,
+	IN_FIRE        = 1 << 4,
+	IN_LEVEL_SHIFT = 5,			// 0 = no change, n = select level n - 1
+	IN_LEVEL_MASK  = 0xF << IN_LEVEL_SHIFT
+};
+
+word ReadInput()
+{
+	word bits = 0;
+	if (KeyDown(SYS_KEY_UP))    bits |= IN_UP;
+	if (KeyDown(SYS_KEY_DOWN))  bits |= IN_DOWN;
+	if (KeyDown(SYS_KEY_LEFT))  bits |= IN_LEFT;
+	if (KeyDown(SYS_KEY_RIGHT)) bits |= IN_RIGHT;
+	if (KeyDown(' '))           bits |= IN_FIRE;
+
+	// Level select on the press only, holding the key doesn't restart every tick
+	for (int i = 0; i < 9; i++)
+		if (KeyHit('1' + i))
+		{
+			bits |= (word)((i + 1) << IN_LEVEL_SHIFT);
+			break;
+		}
+	return bits;
+}
+
+//-----------------------------------------------------------------------------
+void ProcessInput(word input)
 {
 	if (g_gs == GS_PLAYING)
 	{
-		if (SYS_KeyPressed(' ') && g_time_from_last_rocket > MIN_TIME_BETWEEN_ROCKETS)
+		if ((input & IN_FIRE) && g_time_from_last_rocket > MIN_TIME_BETWEEN_ROCKETS)
 		{
 			int e = InsertEntity(E_ROCKET, MAIN_SHIP->pos, vadd(MAIN_SHIP->vel, vmake(0.f, ROCKET_SPEED)),
 				ROCKET_RADIUS, T_ROCKET, true);
@@ -1269,10 +1825,10 @@ void ProcessInput()
 			g_entities[e].psystem_off = vmake(0.f, -120.f);
 		}
 
-		bool up = SYS_KeyPressed(SYS_KEY_UP);
-		bool down = SYS_KeyPressed(SYS_KEY_DOWN);
-		bool left = SYS_KeyPressed(SYS_KEY_LEFT);
-		bool right = SYS_KeyPressed(SYS_KEY_RIGHT);
+		bool up = (input & IN_UP) != 0;
+		bool down = (input & IN_DOWN) != 0;
+		bool left = (input & IN_LEFT) != 0;
+		bool right = (input & IN_RIGHT) != 0;
 
 		// Left-right movement
 		if (left && !right)
@@ -1308,56 +1864,760 @@ void ProcessInput()
 		else                                  MAIN_SHIP->texture = T_SHIP_RR;
 	}
 
-	if (SYS_KeyPressed('1')) ResetNewGame(0);
-	else if (SYS_KeyPressed('2')) ResetNewGame(1);
-	else if (SYS_KeyPressed('3')) ResetNewGame(2);
-	else if (SYS_KeyPressed('4')) ResetNewGame(3);
-	else if (SYS_KeyPressed('5')) ResetNewGame(4);
-	else if (SYS_KeyPressed('6')) ResetNewGame(5);
-	else if (SYS_KeyPressed('7')) ResetNewGame(6);
-	else if (SYS_KeyPressed('8')) ResetNewGame(7);
-	else if (SYS_KeyPressed('9')) ResetNewGame(8);
+	if (input & IN_LEVEL_MASK)
+		ResetNewGame(((input & IN_LEVEL_MASK) >> IN_LEVEL_SHIFT) - 1);
+}
+
+//=============================================================================
+// Replays: the RNG seed, the starting level and the input word of every tick
+// reproduce a run exactly. File layout (little endian): ReplayHeader, then
+// ReplayRun entries, each one input word held for 1..65535 ticks.
+struct ReplayHeader
+{
+	char  magic[4];		// REPLAY_MAGIC
+	word  version;
+	word  level;		// ResetNewGame() level the run starts at
+	dword seed;			// CORE_SeedRand() seed
+	dword ticks;		// Ticks recorded
+	dword checksum;		// StateChecksum() after the last tick
+};
+
+struct ReplayRun
+{
+	word bits;
+	word ticks;
+};
+
+static const char REPLAY_MAGIC[4] = { 'P', '7', 'R', 'P' };
+static const word REPLAY_VERSION = 2;
+
+FILE        *g_record_file = NULL;
+ReplayHeader g_record_header;
+ReplayRun    g_record_run;				// Still growing, written when the input changes
+
+ReplayRun   *g_replay_runs = NULL;
+ReplayHeader g_replay_header;
+size_t       g_replay_num_runs = 0;
+size_t       g_replay_run = 0;			// Run being played back
+unsigned     g_replay_run_ticks = 0;	// Ticks already played from it
+bool         g_replaying = false;
+
+//-----------------------------------------------------------------------------
+// FNV-1a over the sim state that matters, to tell whether a replay desynced
+inline void HashBytes(dword &h, const void *data, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+		h = (h ^ ((const byte *)data)[i]) * 16777619u;
+}
+
+dword StateChecksum()
+{
+	dword h = 2166136261u;
+	for (size_t i = 0; i < MAX_ENTITIES; i++)
+	{
+		const Entity &e = g_entities[i];
+		HashBytes(h, &e.type, sizeof(e.type));
+		if (e.type == E_NULL)
+			continue;
+		HashBytes(h, &e.pos, sizeof(e.pos));
+		HashBytes(h, &e.vel, sizeof(e.vel));
+		HashBytes(h, &e.energy, sizeof(e.energy));
+		HashBytes(h, &e.fuel, sizeof(e.fuel));
+		HashBytes(h, &e.tilt, sizeof(e.tilt));
+	}
+	float camera_offset = g_camera_offset, race_pos = g_current_race_pos;
+	HashBytes(h, &camera_offset, sizeof(camera_offset));
+	HashBytes(h, &race_pos, sizeof(race_pos));
+	HashBytes(h, &g_current_level, sizeof(g_current_level));
+	HashBytes(h, &g_gs, sizeof(g_gs));
+	return h;
+}
+
+//-----------------------------------------------------------------------------
+bool StartRecording(const char filename[], int level, unsigned seed)
+{
+	g_record_file = fopen(filename, "wb");
+	if (!g_record_file)
+		return false;
+
+	memset(&g_record_header, 0, sizeof(g_record_header));
+	memcpy(g_record_header.magic, REPLAY_MAGIC, sizeof(REPLAY_MAGIC));
+	g_record_header.version = REPLAY_VERSION;
+	g_record_header.level = (word)level;
+	g_record_header.seed = seed;
+	fwrite(&g_record_header, sizeof(g_record_header), 1, g_record_file);	// Completed on stop
+
+	g_record_run.bits = 0;
+	g_record_run.ticks = 0;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+void RecordInput(word bits)
+{
+	if (g_record_run.ticks && (g_record_run.bits != bits || g_record_run.ticks == 0xFFFF))
+	{
+		fwrite(&g_record_run, sizeof(g_record_run), 1, g_record_file);
+		g_record_run.ticks = 0;
+	}
+	g_record_run.bits = bits;
+	g_record_run.ticks++;
+	g_record_header.ticks++;
+}
+
+//-----------------------------------------------------------------------------
+void StopRecording()
+{
+	if (g_record_run.ticks)
+		fwrite(&g_record_run, sizeof(g_record_run), 1, g_record_file);
+
+	g_record_header.checksum = StateChecksum();
+	fseek(g_record_file, 0, SEEK_SET);
+	fwrite(&g_record_header, sizeof(g_record_header), 1, g_record_file);
+	fclose(g_record_file);
+	g_record_file = NULL;
+
+	LOG(("Recorded %u ticks, checksum %08x\n", g_record_header.ticks, g_record_header.checksum));
+}
+
+//-----------------------------------------------------------------------------
+bool LoadReplay(const char filename[])
+{
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		return false;
+
+	bool ok = fread(&g_replay_header, sizeof(g_replay_header), 1, f) == 1
+		&& !memcmp(g_replay_header.magic, REPLAY_MAGIC, sizeof(REPLAY_MAGIC))
+		&& g_replay_header.version == REPLAY_VERSION;
+	if (ok)
+	{
+		fseek(f, 0, SEEK_END);
+		long runs_size = ftell(f) - (long)sizeof(g_replay_header);
+		fseek(f, sizeof(g_replay_header), SEEK_SET);
+
+		g_replay_num_runs = runs_size / sizeof(ReplayRun);
+		g_replay_runs = new ReplayRun[g_replay_num_runs + 1];
+		ok = fread(g_replay_runs, sizeof(ReplayRun), g_replay_num_runs, f) == g_replay_num_runs;
+	}
+	fclose(f);
+
+	g_replay_run = 0;
+	g_replay_run_ticks = 0;
+	g_replaying = ok;
+	return ok;
+}
+
+//-----------------------------------------------------------------------------
+// Input word for the next tick, false once the replay has run out
+bool ReplayInput(word &bits)
+{
+	while (g_replay_run < g_replay_num_runs && g_replay_run_ticks == g_replay_runs[g_replay_run].ticks)
+	{
+		g_replay_run++;
+		g_replay_run_ticks = 0;
+	}
+	if (g_replay_run == g_replay_num_runs)
+		return false;
+
+	bits = g_replay_runs[g_replay_run].bits;
+	g_replay_run_ticks++;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+void EndReplay(unsigned ticks_played)
+{
+	dword checksum = StateChecksum();
+	LOG(("Replay: %u of %u ticks, checksum %08x, expected %08x: %s\n", ticks_played, g_replay_header.ticks,
+		checksum, g_replay_header.checksum,
+		ticks_played == g_replay_header.ticks && checksum == g_replay_header.checksum ? "OK" : "DESYNC"));
+
+	delete[] g_replay_runs;
+	g_replay_runs = NULL;
+	g_replaying = false;
 }
 
 //-----------------------------------------------------------------------------
 // Game state (apart from entities & other stand-alone modules)
 float g_time = 0.f;
 
+// Main loop statistics
+unsigned g_sim_ticks = 0;
+unsigned g_sim_ticks_extra = 0;		// Catch-up ticks (more than one per loop)
+unsigned g_sim_ticks_dropped = 0;		// Ticks skipped by the spiral-of-death clamp
+unsigned g_render_frames = 0;			// Written by the render side only
+
+//-----------------------------------------------------------------------------
+// Profiler overlay, toggled with 'P': min/avg/p99 ms per zone over the last
+// PROF_HISTORY frames, children indented under their parents.
+static const float PROF_HUD_CHAR = 20.f;
+std::atomic<bool> g_show_profiler(false);
+
+// GL state calls made & skipped by core, last frame and in total
+CORE_GLStats g_gl_stats = { 0, 0 };
+qword        g_gl_issued = 0, g_gl_elided = 0;
+qword        g_culled_sprites = 0;	// Total of g_culled over all frames
+
+// -dump: software rendered frames as .bmp, every one if the name has a %d
+// (or a #) for the frame number in it, else just the last one
+const char  *g_dump_name = NULL;
+int          g_dump_prefix_len = -1;	// Chars before the frame number, -1 if no placeholder
+const char  *g_dump_suffix = NULL;		// What follows the placeholder
+
+// Split the -dump name around its frame number placeholder. The name is never
+// used as a format, so a single %d or # is all it may hold.
+bool ParseDumpName(const char *name)
+{
+	g_dump_prefix_len = -1;
+	g_dump_suffix = NULL;
+	for (const char *c = name; *c; c++)
+	{
+		int len = (c[0] == '%' && c[1] == 'd') ? 2 : (c[0] == '#') ? 1 : 0;
+		if (len && g_dump_prefix_len < 0)
+		{
+			g_dump_prefix_len = (int)(c - name);
+			g_dump_suffix = c + len;
+			c += len - 1;
+		}
+		else if (*c == '%' || len)
+			return false;
+	}
+	return true;
+}
+
+void RenderProfiler()
+{
+	PROF_Stats stats[PROF_MAX_ZONES];
+	int num_stats = PROF_GetStats(stats, PROF_MAX_ZONES);
+
+	char line[64];
+	vec2 pos = vmake(ENERGY_BAR_W + PROF_HUD_CHAR, G_HEIGHT - PROF_HUD_CHAR);
+	for (int i = -1; i < num_stats; i++)
+	{
+		if (i < 0)
+			sprintf(line, "%-20s %6s %6s %6s", "ZONE", "MIN", "AVG", "P99");
+		else
+			sprintf(line, "%*s%-*s %6.2f %6.2f %6.2f", 2 * stats[i].depth, "",
+				20 - 2 * stats[i].depth, stats[i].name, stats[i].min_ms, stats[i].avg_ms, stats[i].p99_ms);
+
+		// Drop shadow, to stay readable over any terrain
+		CORE_RenderText(vadd(pos, vmake(2.f, -2.f)), PROF_HUD_CHAR, line, Tex(T_FONT), MakeRGBA(0.f, 0.f, 0.f, 0.8f));
+		CORE_RenderText(pos, PROF_HUD_CHAR, line, Tex(T_FONT));
+		pos.y -= 1.25f * PROF_HUD_CHAR;
+	}
+
+	sprintf(line, "GL STATE %u SET %u SKIPPED", g_gl_stats.issued, g_gl_stats.elided);
+	CORE_RenderText(vadd(pos, vmake(2.f, -2.f)), PROF_HUD_CHAR, line, Tex(T_FONT), MakeRGBA(0.f, 0.f, 0.f, 0.8f));
+	CORE_RenderText(pos, PROF_HUD_CHAR, line, Tex(T_FONT));
+	pos.y -= 1.25f * PROF_HUD_CHAR;
+
+	sprintf(line, "CULLED %u ENT %u SHADOW %u PART", g_culled.entities, g_culled.shadows, g_culled.particles);
+	CORE_RenderText(vadd(pos, vmake(2.f, -2.f)), PROF_HUD_CHAR, line, Tex(T_FONT), MakeRGBA(0.f, 0.f, 0.f, 0.8f));
+	CORE_RenderText(pos, PROF_HUD_CHAR, line, Tex(T_FONT));
+	CORE_FlushSprites();
+}
+
+//-----------------------------------------------------------------------------
+// Render side: draw the newest snapshot and present it
+void RenderFrame()
+{
+	PROF_ZONE("RenderFrame");
+	PROF_Collect();
+
+	const WorldSnapshot *snap = AcquireSnapshot();
+	float alpha = (float)((SYS_GetTime() - snap->time) / SIM_STEP);
+	Render(*snap, Max(0.f, Min(alpha, 1.f)));
+	g_culled_sprites += g_culled.entities + g_culled.shadows + g_culled.particles;
+	if (g_show_profiler.load())
+		RenderProfiler();
+
+	if (CORE_IsSoftRender())
+	{
+		PROF_ZONE("PresentSoft");
+		CORE_PresentSoft();
+		if (g_dump_name && g_dump_prefix_len >= 0)
+		{
+			char filename[256];
+			snprintf(filename, sizeof(filename), "%.*s%u%s", g_dump_prefix_len, g_dump_name,
+				g_render_frames, g_dump_suffix);
+			CORE_DumpSoftFrame(filename);
+		}
+	}
+
+	g_gl_stats = CORE_TakeGLStats();
+	g_gl_issued += g_gl_stats.issued;
+	g_gl_elided += g_gl_stats.elided;
+
+	{
+		PROF_ZONE("SYS_Show");
+		SYS_Show();
+	}
+	g_render_frames++;
+}
+
+//-----------------------------------------------------------------------------
+// Render thread, paced by SYS_Show (vsync). Wakes the sim after every present.
+std::atomic<bool>       g_render_quit(false);
+std::mutex              g_present_mutex;
+std::condition_variable g_present_cv;
+unsigned                g_presents = 0;
+
+void RenderThread()
+{
+	PROF_SetThreadName("Render");
+	SYS_AcquireGL();
+	while (!g_render_quit.load())
+	{
+		RenderFrame();
+
+		std::lock_guard<std::mutex> lock(g_present_mutex);
+		g_presents++;
+		g_present_cv.notify_one();
+	}
+	SYS_ReleaseGL();
+}
+
+//-----------------------------------------------------------------------------
+// Sim side: sleep until the next present or until the next tick is due
+void WaitForPresent(double timeout)
+{
+	std::unique_lock<std::mutex> lock(g_present_mutex);
+	unsigned presents = g_presents;
+	g_present_cv.wait_for(lock, std::chrono::duration<double>(timeout),
+		[presents] { return g_presents != presents; });
+}
+
+#ifndef P7_BENCH
+//-----------------------------------------------------------------------------
+// Textures & sounds load on the loader threads while a loading screen shows.
+// The loader stays up after, tilesets come & go through it while playing.
+// Progress goes up in fixed steps, one frame each, so a replay's frames don't
+// depend on how fast the disk was. A quit ends the screen early. The screen's
+// font is a synchronous load of its own, made before the atlas opens: the
+// real one is in the atlas, and isn't drawable until CORE_EndAtlas(), so the
+// two aren't shared.
+static const int LOADING_STEPS = 10;
+static const char ARCHIVE_FILE[] = "data/protocol7.p7a";	// make cook
+
+void LoadAssets()
+{
+	PROF_ZONE("LoadAssets");
+	if (!SYS_GetArg("-loose") && CORE_OpenArchive(ARCHIVE_FILE))
+		LOG(("Loading from '%s'\n", ARCHIVE_FILE));
+	int font = CORE_LoadBmp(textures[T_FONT].name, false, false);
+	CORE_StartAssetLoader(0);
+	LoadTextures();
+	LoadSounds();
+
+	int total = (int)(T_TILES_G_ON_S + ArraySize(sounds));
+	int pending = CORE_PumpAssets(false);
+	for (int step = 0; step <= LOADING_STEPS; step++)
+	{
+		while (total - pending < total * step / LOADING_STEPS)
+			pending = CORE_PumpAssets(true);
+
+		char line[32];
+		snprintf(line, sizeof(line), "LOADING %d%%", 100 * step / LOADING_STEPS);
+		float size = 16.f;
+		SYS_Pump();
+		if (SYS_GottaQuit())
+			break;
+		CORE_Clear(CLEAR_COLOR);
+		CORE_RenderText(vmake(.5f * (G_WIDTH - size * strlen(line)), .5f * (G_HEIGHT + size)), size, line, font);
+		CORE_FlushSprites();
+		if (CORE_IsSoftRender())
+			CORE_PresentSoft();
+		SYS_Show();
+	}
+	// Cut short by a quit, the atlas still wants the rest
+	while (pending)
+		pending = CORE_PumpAssets(true);
+	CORE_UnloadBmp(font);
+
+	int pages = CORE_EndAtlas();
+	LOG(("%d textures in %d atlas page(s)\n", (int)T_TILES_G_ON_S, pages));
+}
+
+//-----------------------------------------------------------------------------
+// Packs every texture & sound into one archive for LoadAssets()
+bool CookArchive(const char filename[])
+{
+	const char *names[ArraySize(textures) + ArraySize(sounds)];
+	int num_names = 0;
+	for (size_t i = 0; i < ArraySize(textures); i++)
+		names[num_names++] = textures[i].name;
+	for (size_t i = 0; i < ArraySize(sounds); i++)
+		names[num_names++] = sounds[i].name;
+
+	int cooked = CORE_CookArchive(filename, names, num_names);
+	if (cooked < 0)
+		LOG(("Can't write '%s'\n", filename));
+	else
+		LOG(("%d of %d files cooked into '%s'\n", cooked, num_names, filename));
+	return cooked == num_names;
+}
+
 //-----------------------------------------------------------------------------
 // Main
 int Main(void)
 {
 	// Start things up & load resources ---------------------------------------------------
-	CORE_InitSound();
-	LoadTextures();
-	LoadSounds();
-	ResetNewGame(0);
+	PROF_SetThreadName("Main");
+	const char *trace_file = SYS_GetArg("-trace");
+	if (trace_file && *trace_file && !PROF_StartTrace(trace_file))
+		LOG(("Can't write trace file '%s'\n", trace_file));
+
+	// Cooking the asset archive is all a -cook run does
+	const char *arg;
+	if ((arg = SYS_GetArg("-cook")) != NULL)
+		return CookArchive(*arg ? arg : ARCHIVE_FILE) ? 0 : -1;
+
+	// Runs are reproducible from the seed & level, which a replay brings along
+	unsigned seed = 1;
+	int level = 0;
+	if ((arg = SYS_GetArg("-seed")) && *arg)
+		seed = (unsigned)strtoul(arg, NULL, 0);
+	if ((arg = SYS_GetArg("-level")) && *arg)
+		level = atoi(arg) - 1;
+	if ((arg = SYS_GetArg("-replay")) && *arg)
+	{
+		if (LoadReplay(arg))
+		{
+			seed = g_replay_header.seed;
+			level = g_replay_header.level;
+		}
+		else
+			LOG(("Can't load replay '%s'\n", arg));
+	}
 
-	// Set up rendering ---------------------------------------------------------------------
+	// Software rendering on request, before textures load so they get CPU copies
+	if ((arg = SYS_GetArg("-soft")) != NULL)
+	{
+		if (CORE_InitSoftRender(SYS_WIDTH, SYS_HEIGHT, atoi(arg)))
+			LOG(("Using the software renderer\n"));
+		else
+			LOG(("Can't start the software renderer\n"));
+	}
+	g_dump_name = SYS_GetArg("-dump");
+	if (g_dump_name && !ParseDumpName(g_dump_name))
+	{
+		LOG(("Bad -dump name '%s', use a single %%d or # for the frame number\n", g_dump_name));
+		g_dump_name = NULL;
+	}
+
+	// Set up rendering, the loading screen needs it --------------------------------------
 	glViewport(0, 0, SYS_WIDTH, SYS_HEIGHT);
-	glClearColor(0.0f, 0.1f, 0.3f, 0.0f);
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
-	glOrtho(0.0, G_WIDTH, 0.0, G_HEIGHT, 0.0, 1.0);
+	CORE_SetView(G_WIDTH, G_HEIGHT);
 	glEnable(GL_TEXTURE_2D);
 	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);	// Textures & colours are premultiplied
+
+	CORE_InitSound();
+	LoadAssets();
+	CORE_SeedRand(seed);
+	ResetNewGame(level);
+	RequireTileset(TilesetOf(g_active_tileset));
+
+	if ((arg = SYS_GetArg("-record")) && *arg && !StartRecording(arg, g_current_level, seed))
+		LOG(("Can't write replay '%s'\n", arg));
+
+	// GL 3.x extras: a terrain cache unless told otherwise, instancing on request
+	bool gl33 = !CORE_IsSoftRender() && SYS_LoadGL33();
+	if (gl33 && !SYS_GetArg("-nocache"))
+		InitTerrainCache(SYS_GetArg("-tilemap") != NULL);
+	if (SYS_GetArg("-gl33"))
+	{
+		if (gl33 && CORE_InitInstancing())
+			LOG(("Using the GL 3.3 instanced sprite pipeline\n"));
+		else
+			LOG(("GL 3.3 unavailable, using the fixed-function pipeline\n"));
+	}
+
+	// Give the renderer something to draw before the first tick
+	GenTerrain(g_camera_offset + G_HEIGHT);
+	PublishSnapshot(SYS_GetTime());
+
+	// GL belongs to the render thread from now on
+	std::thread render_thread;
+	if (SYS_RENDER_THREAD)
+	{
+		SYS_ReleaseGL();
+		render_thread = std::thread(RenderThread);
+	}
 
 	// Main game loop! ======================================================================
-	while (!SYS_GottaQuit())
+	// The simulation advances in fixed FRAMETIME steps and publishes a snapshot
+	// after them. The renderer draws the newest snapshot, on its own thread where
+	// the platform allows it, so frame N renders while frame N+1 simulates.
+	double last_time = SYS_GetTime();
+	double sim_accum = SIM_STEP; // Run the first tick right away
+	bool replay_done = false;
+	while (!SYS_GottaQuit() && !replay_done)
 	{
-		Render();
-		SYS_Show();
-		ProcessInput();
-		RunGame();
-		SYS_Pump();
-		SYS_Sleep(16);
-		g_time += FRAMETIME;
+		PROF_ZONE("Frame");
+		{
+			PROF_ZONE("SYS_Pump");
+			SYS_Pump();
+			GatherInput();
+		}
+		if (SYS_KeyHit('P'))
+			g_show_profiler.store(!g_show_profiler.load());
+
+		double now = SYS_GetTime();
+		double frame_time = now - last_time;
+		last_time = now;
+
+		// Timers jitter around the display refresh, don't let that cause 0/2 tick frames
+		double whole_steps = floor(frame_time / SIM_STEP + .5);
+		if (whole_steps >= 1.0 && fabs(frame_time - whole_steps * SIM_STEP) < SIM_STEP_SNAP)
+			frame_time = whole_steps * SIM_STEP;
+
+		// Replays run flat out, a tick per loop without waiting for the display
+		if (g_replaying)
+			frame_time = SIM_STEP;
+		sim_accum += frame_time;
+
+		int ticks = 0;
+		{
+			PROF_ZONE("Sim");
+			while (sim_accum >= SIM_STEP)
+			{
+				if (ticks == MAX_SIM_STEPS_PER_FRAME)
+				{
+					unsigned dropped = (unsigned)(sim_accum / SIM_STEP);
+					sim_accum -= dropped * SIM_STEP;
+					g_sim_ticks_dropped += dropped;
+					LOG(("Tick %u: dropped %u sim ticks (%.1f ms frame)\n", g_sim_ticks + ticks, dropped, 1000.0 * frame_time));
+					break;
+				}
+
+				word input = ReadInput();
+				ConsumeInputEdges();
+				if (g_replaying && !ReplayInput(input))
+				{
+					replay_done = true;
+					break;
+				}
+				if (g_record_file)
+					RecordInput(input);
+
+				ProcessInput(input);
+				RunGame();
+				g_time += FRAMETIME;
+				sim_accum -= SIM_STEP;
+				ticks++;
+			}
+		}
+		g_sim_ticks += ticks;
+		if (ticks > 1)
+			g_sim_ticks_extra += ticks - 1;
+
+		if (ticks > 0)
+		{
+			PROF_ZONE("PublishSnapshot");
+			PublishSnapshot(now - sim_accum);
+		}
+
+		if (!SYS_RENDER_THREAD)
+			RenderFrame();
+		else if (!g_replaying)
+		{
+			PROF_ZONE("WaitForPresent");
+			WaitForPresent(SIM_STEP - sim_accum);
+		}
 	}
 
+	if (SYS_RENDER_THREAD)
+	{
+		g_render_quit.store(true);
+		render_thread.join();
+		SYS_AcquireGL();
+	}
+
+	LOG(("Main loop: %u frames, %u sim ticks (%u extra, %u dropped)\n",
+		g_render_frames, g_sim_ticks, g_sim_ticks_extra, g_sim_ticks_dropped));
+	if (g_render_frames)
+	{
+		LOG(("GL state calls per frame: %.1f set, %.1f skipped\n",
+			g_gl_issued / (double)g_render_frames, g_gl_elided / (double)g_render_frames));
+		LOG(("Off-screen sprites culled per frame: %.1f\n", g_culled_sprites / (double)g_render_frames));
+	}
+	if (g_record_file)
+		StopRecording();
+	if (g_replaying)
+		EndReplay(g_sim_ticks);
+
+	PROF_Stats stats[PROF_MAX_ZONES];
+	int num_stats = PROF_GetStats(stats, PROF_MAX_ZONES);
+	for (int i = 0; i < num_stats; i++)
+		LOG(("  %*s%-*s min %.3f avg %.3f p99 %.3f ms\n", 2 * stats[i].depth, "", 20 - 2 * stats[i].depth,
+			stats[i].name, stats[i].min_ms, stats[i].avg_ms, stats[i].p99_ms));
+
+	if (g_dump_name && *g_dump_name && g_dump_prefix_len < 0 && CORE_IsSoftRender()
+		&& !CORE_DumpSoftFrame(g_dump_name))
+		LOG(("Can't write '%s'\n", g_dump_name));
+
 	UnloadSounds();
+	EndTerrainCache();
+	UnloadTilesets();
 	UnloadTextures();
+	CORE_StopAssetLoader();
+	CORE_CloseArchive();
+	CORE_EndSoftRender();
+	CORE_EndInstancing();
 	CORE_EndSound();
 
+	PROF_StopTrace();
 	return 0;
-}
\ No newline at end of file
+}
+
+#else // P7_BENCH
+//=============================================================================
+// Benchmark: runs the simulation alone (no rendering, no waiting) through
+// every level with an autopilot at the controls, and reports the profiler
+// totals per level as JSON. Same seed, same ticks, same numbers to compare.
+// Crashes don't drain energy here, so each run goes all the way to victory.
+//
+//   protocol7_bench [-ticks N] [-seed N] [-json out.json] [-trace out.json]
+
+//-----------------------------------------------------------------------------
+// Full speed ahead: pick the lane with the fewest live obstacles ahead
+// (nearer ones count more), steer to it and shoot whatever is in the way
+word AutopilotInput()
+{
+	static const float LANE_STEP = 50.f;
+	static const float LOOK_AHEAD = 1500.f;
+
+	word  bits = IN_UP;
+	float best_x = MAIN_SHIP->pos.x, best_cost = 1e30f;
+	for (float x = MAINSHIP_RADIUS; x <= G_WIDTH - MAINSHIP_RADIUS; x += LANE_STEP)
+	{
+		float cost = .0001f * fabs(x - MAIN_SHIP->pos.x);	// Rather not move for nothing
+		for (size_t i = 0; i < MAX_ENTITIES; i++)
+		{
+			const Entity &e = g_entities[i];
+			if (e.type != E_ROCK && e.type != E_MINE && e.type != E_DRONE)
+				continue;
+			if (e.type == E_ROCK && e.energy <= 0.f)
+				continue;	// Already hit, harmless
+
+			float ahead = e.pos.y - MAIN_SHIP->pos.y;
+			if (ahead > -MAINSHIP_RADIUS && ahead < LOOK_AHEAD && fabs(e.pos.x - x) < e.radius + MAINSHIP_RADIUS + 20.f)
+				cost += 1.f / (Max(ahead, 0.f) + 100.f);
+		}
+		if (cost < best_cost)
+		{
+			best_cost = cost;
+			best_x = x;
+		}
+	}
+
+	// Steer by where the drift will leave us, tilt takes a while to wind down
+	float drift_x = MAIN_SHIP->pos.x + 10.f * MAIN_SHIP->vel.x;
+	if (best_x < drift_x - LANE_STEP / 2) bits |= IN_LEFT;
+	if (best_x > drift_x + LANE_STEP / 2) bits |= IN_RIGHT;
+	if (best_cost > .001f) bits |= IN_FIRE;	// Boxed in, clear the way
+	return bits;
+}
+
+//-----------------------------------------------------------------------------
+// The zones the benchmark is about, written out even where they never ran
+static const char *BENCH_ZONES[] = { "RunGame", "RunPSystems", "GenNextElements", "GenTerrain" };
+
+void WriteBenchZones(FILE *f, const PROF_Stats stats[], int num_stats, unsigned ticks)
+{
+	fprintf(f, "{");
+	for (int i = 0; i < num_stats; i++)
+		fprintf(f, "%s\"%s\": {\"ns_per_frame\": %.1f, \"calls_per_frame\": %.3f}", i ? ", " : "",
+			stats[i].name, stats[i].total_ns / ticks, (double)stats[i].total_calls / ticks);
+
+	// PROF_GetStats() leaves out zones without samples
+	bool first = num_stats == 0;
+	for (size_t z = 0; z < ArraySize(BENCH_ZONES); z++)
+	{
+		int i = 0;
+		while (i < num_stats && strcmp(stats[i].name, BENCH_ZONES[z]))
+			i++;
+		if (i < num_stats)
+			continue;
+		fprintf(f, "%s\"%s\": {\"ns_per_frame\": 0.0, \"calls_per_frame\": 0.000}", first ? "" : ", ", BENCH_ZONES[z]);
+		first = false;
+	}
+	fprintf(f, "}");
+}
+
+//-----------------------------------------------------------------------------
+int Main(void)
+{
+	unsigned ticks = 20000;
+	unsigned seed = 1;
+	const char *arg;
+	if ((arg = SYS_GetArg("-ticks")) && *arg)
+		ticks = Max(1u, (unsigned)strtoul(arg, NULL, 0));
+	if ((arg = SYS_GetArg("-seed")) && *arg)
+		seed = (unsigned)strtoul(arg, NULL, 0);
+
+	FILE *out = stdout;
+	if ((arg = SYS_GetArg("-json")) && *arg && !(out = fopen(arg, "w")))
+	{
+		fprintf(stderr, "Can't write '%s'\n", arg);
+		return -1;
+	}
+	const char *trace_file = SYS_GetArg("-trace");
+	if (trace_file && *trace_file && !PROF_StartTrace(trace_file))
+		fprintf(stderr, "Can't write trace file '%s'\n", trace_file);
+
+	// Registered up front, so they lead the stats in this order
+	for (size_t i = 0; i < ArraySize(BENCH_ZONES); i++)
+		PROF_RegisterZone(BENCH_ZONES[i]);
+
+	fprintf(out, "{\n  \"ticks_per_level\": %u,\n  \"seed\": %u,\n  \"levels\": [\n", ticks, seed);
+	long long all_start = PROF_Now();
+	for (int level = 0; level < (int)NUM_LEVELS; level++)
+	{
+		CORE_SeedRand(seed);
+		ResetNewGame(level);
+		PROF_Collect();
+		PROF_ResetTotals();
+
+		unsigned hits = 0, deaths = 0, finishes = 0;
+		long long start = PROF_Now();
+		for (unsigned t = 0; t < ticks; t++)
+		{
+			GameState gs = g_gs;
+			float energy = MAIN_SHIP->energy;
+			ProcessInput(AutopilotInput());
+			RunGame();
+
+			// Crashes still cost speed, but not the run: the whole level gets covered
+			if (MAIN_SHIP->energy < energy)
+			{
+				MAIN_SHIP->energy = energy;
+				hits++;
+			}
+			if (gs != GS_DYING && g_gs == GS_DYING) deaths++;
+			if (gs != GS_VICTORY && g_gs == GS_VICTORY) finishes++;
+
+			// Victory moves on to the next level, stay on this one
+			if (g_current_level != level)
+				ResetNewGame(level);
+			PROF_Collect();
+		}
+		double wall_ns = (double)(PROF_Now() - start);
+
+		PROF_Stats stats[PROF_MAX_ZONES];
+		int num_stats = PROF_GetStats(stats, PROF_MAX_ZONES);
+		fprintf(out, "    {\"level\": %d, \"hits\": %u, \"deaths\": %u, \"finishes\": %u, \"wall_ns_per_frame\": %.1f, \"zones\": ",
+			level + 1, hits, deaths, finishes, wall_ns / ticks);
+		WriteBenchZones(out, stats, num_stats, ticks);
+		fprintf(out, "}%s\n", level + 1 < (int)NUM_LEVELS ? "," : "");
+	}
+	fprintf(out, "  ],\n  \"wall_ns_per_frame\": %.1f\n}\n", (double)(PROF_Now() - all_start) / (ticks * NUM_LEVELS));
+
+	if (out != stdout)
+		fclose(out);
+	PROF_StopTrace();
+	return 0;
+}
+#endif // P7_BENCH
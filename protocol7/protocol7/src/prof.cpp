@@ -0,0 +1,377 @@
+/*
+ * prof.cpp - Implementation of the frame profiler
+ */
+#include "stdafx.h"
+#include "base.h"
+#include "prof.h"
+
+#include <chrono>
+#include <algorithm>
+#include <vector>
+
+//=============================================================================
+// Zone registry. Names are static strings from the PROF_ZONE sites.
+
+static const char      *PROF_zone_names[PROF_MAX_ZONES];
+static std::atomic<int> PROF_num_zones(0);
+static std::mutex       PROF_zone_mutex;
+
+//-----------------------------------------------------------------------------
+int PROF_RegisterZone(const char name[])
+{
+	std::lock_guard<std::mutex> lock(PROF_zone_mutex);
+
+	int n = PROF_num_zones.load(std::memory_order_relaxed);
+	for ( int i = 0; i < n; i++ )
+		if ( !strcmp(PROF_zone_names[i], name) )
+			return i;
+
+	if ( n == PROF_MAX_ZONES )
+		return -1;
+	PROF_zone_names[n] = name;
+	PROF_num_zones.store(n + 1, std::memory_order_release);
+	return n;
+}
+
+//-----------------------------------------------------------------------------
+long long PROF_Now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//=============================================================================
+// Event ring: many writers, one reader, no locks.
+//
+// A writer claims a position with a fetch_add, fills the slot and publishes it
+// by storing 2*pos+2 in the slot sequence (2*pos+1 while it is being filled).
+// The reader consumes slots strictly in order and stops at the first one that
+// isn't published yet. If writers lap the reader, it skips ahead and counts
+// the lost events instead of blocking anybody.
+
+static const unsigned PROF_RING_SIZE = 1 << 14;
+static const unsigned PROF_RING_MASK = PROF_RING_SIZE - 1;
+
+struct PROF_Slot
+{
+	std::atomic<unsigned> seq;
+	PROF_Event            ev;
+};
+
+static PROF_Slot             PROF_ring[PROF_RING_SIZE];
+static std::atomic<unsigned> PROF_head(0);	// Next position to claim
+static unsigned              PROF_tail = 0;	// Next position to read, reader only
+static unsigned              PROF_dropped = 0;
+
+static const int             PROF_MAX_THREADS = 256;
+static std::atomic<int>      PROF_num_threads(0);
+static const char           *PROF_thread_names[PROF_MAX_THREADS];
+static thread_local int      PROF_thread = -1;
+static thread_local int      PROF_depth = 0;
+
+//-----------------------------------------------------------------------------
+static int PROF_ThreadIndex()
+{
+	if ( PROF_thread < 0 )
+		PROF_thread = PROF_num_threads.fetch_add(1) % PROF_MAX_THREADS;
+	return PROF_thread;
+}
+
+//-----------------------------------------------------------------------------
+void PROF_SetThreadName(const char name[])
+{
+	PROF_thread_names[PROF_ThreadIndex()] = name;
+}
+
+//-----------------------------------------------------------------------------
+void PROF_Emit(int zone, int depth, long long begin, long long end, int kind)
+{
+	if ( zone < 0 )
+		return;
+	int thread = PROF_ThreadIndex();
+
+	unsigned pos = PROF_head.fetch_add(1, std::memory_order_relaxed);
+	PROF_Slot &slot = PROF_ring[pos & PROF_RING_MASK];
+
+	slot.seq.store(2 * pos + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot.ev.begin = begin;
+	slot.ev.end = end;
+	slot.ev.zone = (short)zone;
+	slot.ev.depth = (byte)std::min(depth, 0xFF);
+	slot.ev.thread = (byte)thread;
+	slot.ev.kind = (byte)kind;
+	slot.seq.store(2 * pos + 2, std::memory_order_release);
+}
+
+//-----------------------------------------------------------------------------
+void PROF_Marker(const char name[])
+{
+	long long now = PROF_Now();
+	PROF_Emit(PROF_RegisterZone(name), 0, now, now, PROF_EV_MARKER);
+}
+
+//-----------------------------------------------------------------------------
+// Takes the next event off the ring, false when there's nothing (yet)
+static bool PROF_Pop(PROF_Event &ev)
+{
+	for ( ;; )
+	{
+		PROF_Slot &slot = PROF_ring[PROF_tail & PROF_RING_MASK];
+		unsigned seq = slot.seq.load(std::memory_order_acquire);
+		if ( seq == 2 * PROF_tail + 2 )
+		{
+			ev = slot.ev;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if ( slot.seq.load(std::memory_order_relaxed) == seq )
+			{
+				PROF_tail++;
+				return true;
+			}
+		}
+
+		// Not published: either still being written, or overwritten by a lap
+		unsigned head = PROF_head.load(std::memory_order_acquire);
+		if ( head - PROF_tail <= PROF_RING_SIZE )
+			return false;
+
+		unsigned skip_to = head - PROF_RING_SIZE / 2;
+		PROF_dropped += skip_to - PROF_tail;
+		PROF_tail = skip_to;
+	}
+}
+
+//-----------------------------------------------------------------------------
+PROF_Scope::PROF_Scope(int z)
+{
+	zone = z;
+	depth = PROF_depth++;
+	begin = PROF_Now();
+}
+
+PROF_Scope::~PROF_Scope()
+{
+	long long end = PROF_Now();
+	PROF_depth--;
+	PROF_Emit(zone, depth, begin, end);
+}
+
+//=============================================================================
+// Statistics, reader side only
+
+struct PROF_ZoneHistory
+{
+	long long frame_ns;			// Accumulating for the frame being collected
+	unsigned  frame_calls;
+	unsigned  last_calls;
+	int       depth;
+	float     samples_ms[PROF_HISTORY];
+	int       num_samples;
+	int       next_sample;
+	long long total_ns;
+	qword     total_calls;
+};
+
+static PROF_ZoneHistory PROF_history[PROF_MAX_ZONES];
+
+static void PROF_TraceEvents(const PROF_Event events[], int num_events);
+
+//-----------------------------------------------------------------------------
+void PROF_Collect()
+{
+	static const int BATCH = 256;
+	PROF_Event batch[BATCH];
+	int        batched = 0;
+
+	PROF_Event ev;
+	while ( PROF_Pop(ev) )
+	{
+		batch[batched++] = ev;
+		if ( batched == BATCH )
+		{
+			PROF_TraceEvents(batch, batched);
+			batched = 0;
+		}
+
+		if ( ev.kind != PROF_EV_ZONE )
+			continue;
+		PROF_ZoneHistory &h = PROF_history[ev.zone];
+		h.frame_ns += ev.end - ev.begin;
+		h.frame_calls++;
+		h.total_ns += ev.end - ev.begin;
+		h.total_calls++;
+		h.depth = ev.depth;
+	}
+	PROF_TraceEvents(batch, batched);
+
+	for ( int i = 0; i < PROF_MAX_ZONES; i++ )
+	{
+		PROF_ZoneHistory &h = PROF_history[i];
+		if ( !h.frame_calls )
+			continue;
+
+		h.samples_ms[h.next_sample] = (float)(h.frame_ns / 1e6);
+		h.next_sample = (h.next_sample + 1) % PROF_HISTORY;
+		h.num_samples = std::min(h.num_samples + 1, PROF_HISTORY);
+		h.last_calls = h.frame_calls;
+		h.frame_ns = 0;
+		h.frame_calls = 0;
+	}
+}
+
+//-----------------------------------------------------------------------------
+int PROF_GetStats(PROF_Stats stats[], int max_stats)
+{
+	int n = 0;
+	int num_zones = PROF_num_zones.load(std::memory_order_acquire);
+	for ( int i = 0; i < num_zones && n < max_stats; i++ )
+	{
+		const PROF_ZoneHistory &h = PROF_history[i];
+		if ( !h.num_samples )
+			continue;
+
+		float sorted[PROF_HISTORY];
+		float sum = 0.f;
+		for ( int s = 0; s < h.num_samples; s++ )
+		{
+			sorted[s] = h.samples_ms[s];
+			sum += sorted[s];
+		}
+		std::sort(sorted, sorted + h.num_samples);
+
+		PROF_Stats &st = stats[n++];
+		st.name = PROF_zone_names[i];
+		st.depth = h.depth;
+		st.calls = h.last_calls;
+		st.samples = h.num_samples;
+		st.min_ms = sorted[0];
+		st.avg_ms = sum / h.num_samples;
+		st.p99_ms = sorted[(h.num_samples * 99 + 99) / 100 - 1];
+		st.total_ns = (double)h.total_ns;
+		st.total_calls = h.total_calls;
+	}
+	return n;
+}
+
+//-----------------------------------------------------------------------------
+void PROF_ResetTotals()
+{
+	for ( int i = 0; i < PROF_MAX_ZONES; i++ )
+	{
+		PROF_history[i].total_ns = 0;
+		PROF_history[i].total_calls = 0;
+	}
+}
+
+//-----------------------------------------------------------------------------
+unsigned PROF_GetDropped()
+{
+	return PROF_dropped;
+}
+
+//=============================================================================
+// Trace writer. PROF_Collect appends drained events to a pending list and the
+// writer thread formats & writes them, so the frame only pays for a copy.
+
+static std::atomic<bool>       PROF_tracing(false);
+static FILE                   *PROF_trace_file = NULL;
+static long long               PROF_trace_start = 0;
+static bool                    PROF_trace_first = true;
+static std::thread             PROF_trace_thread;
+static std::mutex              PROF_trace_mutex;
+static std::condition_variable PROF_trace_cv;
+static std::vector<PROF_Event> PROF_trace_pending;
+static bool                    PROF_trace_quit = false;
+
+//-----------------------------------------------------------------------------
+static void PROF_TraceEvents(const PROF_Event events[], int num_events)
+{
+	if ( !num_events || !PROF_tracing.load(std::memory_order_acquire) )
+		return;
+
+	std::lock_guard<std::mutex> lock(PROF_trace_mutex);
+	PROF_trace_pending.insert(PROF_trace_pending.end(), events, events + num_events);
+	PROF_trace_cv.notify_one();
+}
+
+//-----------------------------------------------------------------------------
+static void PROF_WriteTraceEvent(const PROF_Event &ev)
+{
+	double ts = (ev.begin - PROF_trace_start) / 1e3;
+	const char *sep = PROF_trace_first ? "" : ",\n";
+	PROF_trace_first = false;
+
+	if ( ev.kind == PROF_EV_MARKER )
+		fprintf(PROF_trace_file, "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%.3f,\"pid\":1,\"tid\":%d}",
+			sep, PROF_zone_names[ev.zone], ts, ev.thread);
+	else
+		fprintf(PROF_trace_file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}",
+			sep, PROF_zone_names[ev.zone], ts, (ev.end - ev.begin) / 1e3, ev.thread);
+}
+
+//-----------------------------------------------------------------------------
+static void PROF_TraceThread()
+{
+	std::vector<PROF_Event> events;
+	std::unique_lock<std::mutex> lock(PROF_trace_mutex);
+	for ( ;; )
+	{
+		PROF_trace_cv.wait(lock, [] { return PROF_trace_quit || !PROF_trace_pending.empty(); });
+		if ( PROF_trace_pending.empty() && PROF_trace_quit )
+			break;
+
+		events.swap(PROF_trace_pending);
+		lock.unlock();
+		for ( size_t i = 0; i < events.size(); i++ )
+			PROF_WriteTraceEvent(events[i]);
+		events.clear();
+		lock.lock();
+	}
+}
+
+//-----------------------------------------------------------------------------
+bool PROF_StartTrace(const char filename[])
+{
+	if ( PROF_tracing.load() )
+		return false;
+
+	PROF_trace_file = fopen(filename, "w");
+	if ( !PROF_trace_file )
+		return false;
+	setvbuf(PROF_trace_file, NULL, _IOFBF, 1 << 20);
+
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", PROF_trace_file);
+	PROF_trace_start = PROF_Now();
+	PROF_trace_first = true;
+	PROF_trace_quit = false;
+	PROF_trace_thread = std::thread(PROF_TraceThread);
+	PROF_tracing.store(true, std::memory_order_release);
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+void PROF_StopTrace()
+{
+	if ( !PROF_tracing.load() )
+		return;
+
+	PROF_Collect();
+	PROF_tracing.store(false);
+	{
+		std::lock_guard<std::mutex> lock(PROF_trace_mutex);
+		PROF_trace_quit = true;
+		PROF_trace_cv.notify_one();
+	}
+	PROF_trace_thread.join();
+
+	// Thread names as metadata, now that every thread has shown up
+	int num_threads = std::min(PROF_num_threads.load(), PROF_MAX_THREADS);
+	for ( int i = 0; i < num_threads; i++ )
+		if ( PROF_thread_names[i] )
+			fprintf(PROF_trace_file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				PROF_trace_first ? "" : ",\n", i, PROF_thread_names[i]);
+
+	fputs("\n]}\n", PROF_trace_file);
+	fclose(PROF_trace_file);
+	PROF_trace_file = NULL;
+}
@@ -0,0 +1,87 @@
+/*
+ * prof.h - Scoped frame profiler: timing zones, lock-free event ring & stats
+ */
+#pragma once
+#ifndef	P7_PROF_H_
+#define P7_PROF_H_
+
+#pragma region Zones
+// ============================================================================
+//	Put PROF_ZONE("Name") at the top of a scope to time it. Zones nest, and
+//	any thread may record them. Each closed zone becomes one event in a
+//	fixed-size ring that PROF_Collect() drains, once per frame, from a single
+//	thread. Define P7_NO_PROFILER to compile all zones out.
+static const int PROF_MAX_ZONES = 64;
+static const int PROF_HISTORY = 120;	// Frames kept per zone for min/avg/p99
+
+enum { PROF_EV_ZONE, PROF_EV_MARKER };
+
+struct PROF_Event
+{
+	long long begin, end;	// PROF_Now() ticks
+	short     zone;
+	byte      depth;		// Nesting level on its thread, 0 = outermost
+	byte      thread;		// Small per-thread index, in order of first use
+	byte      kind;			// PROF_EV_xxx
+};
+
+long long PROF_Now();			// Nanoseconds, monotonic & real (even on the null platform)
+int		  PROF_RegisterZone(const char name[]);
+void	  PROF_Emit(int zone, int depth, long long begin, long long end, int kind = PROF_EV_ZONE);
+void	  PROF_Marker(const char name[]);		// Instant event, shows up in traces only
+void	  PROF_SetThreadName(const char name[]);	// Static string, labels the thread in traces
+
+struct PROF_Scope
+{
+	int       zone;
+	int       depth;
+	long long begin;
+
+	PROF_Scope(int z);
+	~PROF_Scope();
+};
+
+#define PROF_CONCAT2(a, b) a##b
+#define PROF_CONCAT(a, b)  PROF_CONCAT2(a, b)
+#ifndef P7_NO_PROFILER
+#define PROF_ZONE(name) \
+	static const int PROF_CONCAT(prof_zone_, __LINE__) = PROF_RegisterZone(name); \
+	PROF_Scope PROF_CONCAT(prof_scope_, __LINE__)(PROF_CONCAT(prof_zone_, __LINE__))
+#else
+#define PROF_ZONE(name) do {} while (0)
+#endif
+#pragma endregion
+
+#pragma region Statistics
+// ============================================================================
+//	Per-frame totals: a zone entered several times in a frame (one per sim
+//	tick, say) counts as the sum of its calls. Frames where a zone didn't run
+//	don't add samples to it.
+struct PROF_Stats
+{
+	const char *name;
+	int         depth;		// Nesting level the zone was last seen at
+	unsigned    calls;		// Calls in the latest frame it ran
+	int         samples;	// Frames in the history, up to PROF_HISTORY
+	float       min_ms, avg_ms, p99_ms;
+	double      total_ns;	// Since PROF_ResetTotals(), for benchmarks
+	qword       total_calls;
+};
+
+void	PROF_Collect();		// Drain the ring, closing one frame of samples
+int		PROF_GetStats(PROF_Stats stats[], int max_stats);
+void	PROF_ResetTotals();
+unsigned PROF_GetDropped();	// Events lost because the ring overflowed
+#pragma endregion
+
+#pragma region Tracing
+// ============================================================================
+//	Trace recording: while active, every event PROF_Collect() drains is also
+//	handed to a writer thread that streams it to a Chrome trace-event JSON
+//	file (chrome://tracing, ui.perfetto.dev). Zones are complete ("X") events,
+//	markers global instant ("i") events, timestamps in us from the start.
+bool	PROF_StartTrace(const char filename[]);
+void	PROF_StopTrace();	// Drains the ring, so call it once the other threads are done
+#pragma endregion
+
+#endif // !P7_PROF_H_
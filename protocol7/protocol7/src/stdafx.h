@@ -6,7 +6,18 @@
 #define P7_STDAFX_H_
 
  //=============================================================================
-#ifdef _WINDOWS
+#if defined(P7_NULL_PLATFORM)
+
+#ifdef _WIN32
+#pragma warning(disable:4996) // Using open/close/read... for file access
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include "sys_null.h"
+
+ //=============================================================================
+#elif defined(_WINDOWS)
 
 #pragma pack(1)
 #pragma warning(disable:4996) // Using open/close/read... for file access
@@ -15,6 +26,7 @@
 #include <windows.h>
 #include <gl/gl.h>
 #include <GL/glu.h>
+#include "sys_gl.h"
 #include <al.h>
 #include <alc.h>
 #include <io.h>
@@ -37,6 +49,7 @@
  // Common includes
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <limits.h>
 #include <string.h>
@@ -44,5 +57,11 @@
 #include <fcntl.h>
 #include <math.h>
 #include <stdarg.h>
+#include <ctype.h>
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #endif // !P7_STDAFX_H_
\ No newline at end of file
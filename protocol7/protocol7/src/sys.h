@@ -33,14 +33,58 @@ void	SYS_Pump();
 void	SYS_Show();
 bool	SYS_GottaQuit();
 void	SYS_Sleep(int ms);
+double	SYS_GetTime();		// Seconds, monotonic & high resolution
+void	SYS_AcquireGL();	// Make the GL context current on the calling thread
+void	SYS_ReleaseGL();	// Detach the GL context from the calling thread
+bool	SYS_LoadGL33();		// Fetch the GL 3.3 entry points, false if the driver lacks them
 bool	SYS_KeyPressed(int key);
+bool	SYS_KeyHit(int key);
 ivec2	SYS_MousePos();
 bool	SYS_MouseButtonPressed(int button);
+void	SYS_Log(const char msg[]);
+const char *SYS_GetArg(const char name[]);	// Value after "-name" on the command line, "" if none, NULL if absent
+const void *SYS_MapFile(const char filename[], size_t *size);	// Whole file read-only, NULL if it can't
+void	SYS_UnmapFile(const void *data, size_t size);
 #pragma endregion
 
-#pragma region Key Bindings
+#pragma region Input
+// ============================================================================
+//	Input snapshot: SYS_Pump builds one per call from window messages, and the
+//	query functions above only read it. Keys & mouse buttons share the table.
+enum { SYS_MAX_KEYS = 256 };
+
+struct SYS_InputState
+{
+	bool   down[SYS_MAX_KEYS];		// Held when the snapshot was taken
+	byte   pressed[SYS_MAX_KEYS];		// Down transitions since the previous snapshot
+	byte   released[SYS_MAX_KEYS];		// Up transitions since the previous snapshot
+	double event_time[SYS_MAX_KEYS];	// SYS_GetTime() of the latest transition
+	ivec2  mouse;
+	double time;					// SYS_GetTime() when the snapshot was taken
+};
+
+const SYS_InputState &SYS_GetInput();
+#pragma endregion
+
+#pragma region Platform Specifics
 //-----------------------------------------------------------------------------
-#ifdef _WINDOWS
+#if defined(P7_NULL_PLATFORM)
+
+//	Same codes as the Windows virtual keys, so scripts/replays are portable
+#define SYS_KEY_UP    0x26
+#define SYS_KEY_DOWN  0x28
+#define SYS_KEY_LEFT  0x25
+#define SYS_KEY_RIGHT 0x27
+
+#define SYS_MB_LEFT   0x01
+#define SYS_MB_RIGHT  0x02
+#define SYS_MB_MIDDLE 0x04
+
+//	Nothing to overlap with GL, and the virtual clock needs lock-step rendering
+#define SYS_RENDER_THREAD 0
+
+//-----------------------------------------------------------------------------
+#elif defined(_WINDOWS)
 
 #define SYS_KEY_UP    VK_UP
 #define SYS_KEY_DOWN  VK_DOWN
@@ -51,6 +95,8 @@ bool	SYS_MouseButtonPressed(int button);
 #define SYS_MB_RIGHT  VK_RBUTTON
 #define SYS_MB_MIDDLE VK_MBUTTON
 
+#define SYS_RENDER_THREAD 1
+
 //-----------------------------------------------------------------------------
 #elif defined(__APPLE__)
 #include "TargetConditionals.h"
@@ -69,6 +115,11 @@ bool	SYS_MouseButtonPressed(int button);
 #endif //defined(__APPLE__)
 //-----------------------------------------------------------------------------
 
+//	Whether Main() renders on a thread of its own (SYS_AcquireGL there)
+#ifndef SYS_RENDER_THREAD
+#define SYS_RENDER_THREAD 0
+#endif
+
 #pragma endregion
 
 #endif // !P7_SYS_H_
\ No newline at end of file
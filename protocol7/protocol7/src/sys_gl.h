@@ -0,0 +1,91 @@
+/*
+ * sys_gl.h - OpenGL 3.3 entry points & constants for the Windows platform
+ *
+ * opengl32.dll only exports GL 1.1, so everything newer is fetched from the
+ * driver by SYS_LoadGL33() into function pointers named like the functions.
+ * Add new entry points to SYS_GL33_PROCS, the loader picks them up.
+ */
+#pragma once
+#ifndef	P7_SYS_GL_H_
+#define P7_SYS_GL_H_
+
+#include <stddef.h>
+
+#pragma region Types & constants
+// ============================================================================
+typedef char		GLchar;
+typedef ptrdiff_t	GLsizeiptr;
+typedef ptrdiff_t	GLintptr;
+
+#ifndef GL_ARRAY_BUFFER
+#define GL_ARRAY_BUFFER		0x8892
+#define GL_STREAM_DRAW		0x88E0
+#define GL_STATIC_DRAW		0x88E4
+#define GL_FRAGMENT_SHADER	0x8B30
+#define GL_VERTEX_SHADER	0x8B31
+#define GL_COMPILE_STATUS	0x8B81
+#define GL_LINK_STATUS		0x8B82
+#endif
+#ifndef GL_TEXTURE_2D_ARRAY
+#define GL_CLAMP_TO_EDGE		0x812F
+#define GL_R8UI					0x8232
+#define GL_TEXTURE0				0x84C0
+#define GL_TEXTURE1				0x84C1
+#define GL_TEXTURE_2D_ARRAY		0x8C1A
+#define GL_RED_INTEGER			0x8D94
+#endif
+#ifndef GL_FRAMEBUFFER
+#define GL_READ_FRAMEBUFFER		0x8CA8
+#define GL_FRAMEBUFFER_COMPLETE	0x8CD5
+#define GL_COLOR_ATTACHMENT0	0x8CE0
+#define GL_FRAMEBUFFER			0x8D40
+#endif
+#pragma endregion
+
+#pragma region Entry points
+// ============================================================================
+#define SYS_GL33_PROCS(P) \
+	P(GLuint,	glCreateShader,				(GLenum type)) \
+	P(void,		glShaderSource,				(GLuint shader, GLsizei count, const GLchar *const *string, const GLint *length)) \
+	P(void,		glCompileShader,			(GLuint shader)) \
+	P(void,		glGetShaderiv,				(GLuint shader, GLenum pname, GLint *params)) \
+	P(void,		glDeleteShader,				(GLuint shader)) \
+	P(GLuint,	glCreateProgram,			(void)) \
+	P(void,		glAttachShader,				(GLuint program, GLuint shader)) \
+	P(void,		glLinkProgram,				(GLuint program)) \
+	P(void,		glGetProgramiv,				(GLuint program, GLenum pname, GLint *params)) \
+	P(void,		glUseProgram,				(GLuint program)) \
+	P(void,		glDeleteProgram,			(GLuint program)) \
+	P(GLint,	glGetUniformLocation,		(GLuint program, const GLchar *name)) \
+	P(void,		glUniform1i,				(GLint location, GLint v0)) \
+	P(void,		glUniform4f,				(GLint location, GLfloat v0, GLfloat v1, GLfloat v2, GLfloat v3)) \
+	P(void,		glGenBuffers,				(GLsizei n, GLuint *buffers)) \
+	P(void,		glDeleteBuffers,			(GLsizei n, const GLuint *buffers)) \
+	P(void,		glBindBuffer,				(GLenum target, GLuint buffer)) \
+	P(void,		glBufferData,				(GLenum target, GLsizeiptr size, const void *data, GLenum usage)) \
+	P(void,		glBufferSubData,			(GLenum target, GLintptr offset, GLsizeiptr size, const void *data)) \
+	P(void,		glGenVertexArrays,			(GLsizei n, GLuint *arrays)) \
+	P(void,		glDeleteVertexArrays,		(GLsizei n, const GLuint *arrays)) \
+	P(void,		glBindVertexArray,			(GLuint array)) \
+	P(void,		glEnableVertexAttribArray,	(GLuint index)) \
+	P(void,		glVertexAttribPointer,		(GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const void *pointer)) \
+	P(void,		glVertexAttribDivisor,		(GLuint index, GLuint divisor)) \
+	P(void,		glDrawArraysInstanced,		(GLenum mode, GLint first, GLsizei count, GLsizei instancecount)) \
+	P(void,		glGenFramebuffers,			(GLsizei n, GLuint *framebuffers)) \
+	P(void,		glDeleteFramebuffers,		(GLsizei n, const GLuint *framebuffers)) \
+	P(void,		glBindFramebuffer,			(GLenum target, GLuint framebuffer)) \
+	P(void,		glFramebufferTexture2D,		(GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level)) \
+	P(GLenum,	glCheckFramebufferStatus,	(GLenum target)) \
+	P(void,		glUniform2f,				(GLint location, GLfloat v0, GLfloat v1)) \
+	P(void,		glActiveTexture,			(GLenum texture)) \
+	P(void,		glTexImage3D,				(GLenum target, GLint level, GLint internalformat, GLsizei width, GLsizei height, GLsizei depth, GLint border, GLenum format, GLenum type, const void *pixels)) \
+	P(void,		glCopyTexSubImage3D,		(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLint zoffset, GLint x, GLint y, GLsizei width, GLsizei height))
+
+#define SYS_GL_DECLARE(ret, name, args) \
+	typedef ret (APIENTRY *name##_proc) args; \
+	extern name##_proc name;
+SYS_GL33_PROCS(SYS_GL_DECLARE)
+#undef SYS_GL_DECLARE
+#pragma endregion
+
+#endif // !P7_SYS_GL_H_
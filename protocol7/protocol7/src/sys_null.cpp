@@ -0,0 +1,323 @@
+/*
+ * sys_null.cpp - SYS function implementation for the null (headless) platform
+ *
+ * No window, no GL context and no audio: the game loop runs as fast as the CPU
+ * allows and keyboard input comes from a script. Usage:
+ *
+ *   protocol7_null [-frames N] [-hz N] [-input script.txt] [-verbose] [game options]
+ *
+ * -frames 0 runs until the game quits by itself (e.g. at the end of a replay).
+ *
+ * Any other "-name [value]" is left to the game, which reads it with
+ * SYS_GetArg (e.g. -trace out.json).
+ *
+ * Time is virtual: every SYS_Show is one refresh of an imaginary -hz display
+ * (60 by default), so the game sees a perfectly paced clock at any speed.
+ *
+ * Script lines are "<frame> <+|-><key> ...", e.g. "120 +LEFT -UP +SPACE".
+ * Keys are UP, DOWN, LEFT, RIGHT, SPACE or a single character ('1'..'9').
+ * Anything after '#' is a comment.
+ */
+#ifdef P7_NULL_PLATFORM
+#include "stdafx.h"
+#include "base.h"
+#include "sys.h"
+
+#include <chrono>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+extern int Main(void);
+
+#pragma region Null platform state
+static const int  NULL_MAX_EVENTS = 4096;
+
+struct NULL_InputEvent
+{
+	unsigned frame;
+	int      key;
+	bool     down;
+};
+
+NULL_InputEvent NULL_events[NULL_MAX_EVENTS];
+int             NULL_num_events = 0;
+int             NULL_next_event = 0;
+SYS_InputState  NULL_Input;			// Snapshot handed to the game by SYS_Pump
+SYS_InputState  NULL_LiveInput;		// Updated as script events are applied
+unsigned        NULL_frame = 0;
+unsigned        NULL_max_frames = 3600;
+double          NULL_hz = 60.0;
+bool            NULL_verbose = false;
+int             NULL_argc = 0;
+char          **NULL_argv = NULL;
+#pragma endregion
+
+//-----------------------------------------------------------------------------
+int NULL_ParseKey(const char name[])
+{
+	if ( !strcmp(name, "UP") )    return SYS_KEY_UP;
+	if ( !strcmp(name, "DOWN") )  return SYS_KEY_DOWN;
+	if ( !strcmp(name, "LEFT") )  return SYS_KEY_LEFT;
+	if ( !strcmp(name, "RIGHT") ) return SYS_KEY_RIGHT;
+	if ( !strcmp(name, "SPACE") ) return ' ';
+	if ( name[0] && !name[1] )    return (byte)name[0];
+	return -1;
+}
+
+//-----------------------------------------------------------------------------
+bool NULL_LoadScript(const char filename[])
+{
+	FILE *f = fopen(filename, "r");
+	if ( !f )
+		return false;
+
+	char line[256];
+	int  line_num = 0;
+	while ( fgets(line, sizeof(line), f) )
+	{
+		line_num++;
+		char *comment = strchr(line, '#');
+		if ( comment )
+			*comment = '\0';
+
+		char *tok = strtok(line, " \t\r\n");
+		if ( !tok )
+			continue;
+		unsigned frame = (unsigned)atoi(tok);
+
+		while ( (tok = strtok(NULL, " \t\r\n")) != NULL )
+		{
+			int key = NULL_ParseKey(tok + 1);
+			if ( (tok[0] != '+' && tok[0] != '-') || key < 0 )
+			{
+				fprintf(stderr, "%s:%d: bad key event '%s'\n", filename, line_num, tok);
+				continue;
+			}
+			if ( NULL_num_events >= NULL_MAX_EVENTS )
+			{
+				fprintf(stderr, "%s:%d: too many key events\n", filename, line_num);
+				break;
+			}
+			NULL_events[NULL_num_events].frame = frame;
+			NULL_events[NULL_num_events].key = key;
+			NULL_events[NULL_num_events].down = (tok[0] == '+');
+			NULL_num_events++;
+		}
+	}
+	fclose(f);
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+void NULL_KeyEvent(int key, bool down)
+{
+	if ( key < 0 || key >= SYS_MAX_KEYS || NULL_LiveInput.down[key] == down )
+		return;
+
+	byte &count = down ? NULL_LiveInput.pressed[key] : NULL_LiveInput.released[key];
+	if ( count < 0xFF )
+		count++;
+	NULL_LiveInput.down[key] = down;
+	NULL_LiveInput.event_time[key] = SYS_GetTime();
+}
+
+//-----------------------------------------------------------------------------
+// Apply all scripted key events due by the current frame
+void NULL_ApplyScript()
+{
+	while ( NULL_next_event < NULL_num_events && NULL_events[NULL_next_event].frame <= NULL_frame )
+	{
+		NULL_KeyEvent(NULL_events[NULL_next_event].key, NULL_events[NULL_next_event].down);
+		NULL_next_event++;
+	}
+}
+
+//-----------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+	NULL_argc = argc;
+	NULL_argv = argv;
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( !strcmp(argv[i], "-frames") && i + 1 < argc )
+			NULL_max_frames = (unsigned)atoi(argv[++i]);
+		else if ( !strcmp(argv[i], "-hz") && i + 1 < argc )
+			NULL_hz = atof(argv[++i]);
+		else if ( !strcmp(argv[i], "-input") && i + 1 < argc )
+		{
+			if ( !NULL_LoadScript(argv[++i]) )
+			{
+				fprintf(stderr, "Can't open input script '%s'\n", argv[i]);
+				return -1;
+			}
+		}
+		else if ( !strcmp(argv[i], "-verbose") )
+			NULL_verbose = true;
+		else if ( argv[i][0] != '-' || !strcmp(argv[i], "-help") )
+		{
+			fprintf(stderr, "Usage: %s [-frames N] [-hz N] [-input script.txt] [-verbose]\n"
+				"       [-trace out.json] [-record|-replay run.p7r] [-seed N] [-level 1..9]\n       [-gl33] [-nocache|-tilemap] [-soft [threads]] [-dump frame.bmp]\n"
+					"       [-loose] [-cook archive.p7a]\n", argv[0]);
+			return -1;
+		}
+		else if ( i + 1 < argc && argv[i + 1][0] != '-' )
+			i++;	// Game option with a value, see SYS_GetArg
+	}
+	if ( NULL_hz <= 0.0 )
+		NULL_hz = 60.0;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	int retval = Main();
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	// On stderr, so stdout is all the game's (e.g. benchmark JSON)
+	if ( NULL_frame )
+		fprintf(stderr, "%u frames in %.3f s (%.0f frames/s)\n", NULL_frame, secs, secs > 0.0 ? NULL_frame / secs : 0.0);
+	return retval;
+}
+
+//-----------------------------------------------------------------------------
+void SYS_Pump()
+{
+	NULL_ApplyScript();
+
+	NULL_LiveInput.mouse.x = SYS_WIDTH / 2;
+	NULL_LiveInput.mouse.y = SYS_HEIGHT / 2;
+	NULL_LiveInput.time = SYS_GetTime();
+	NULL_Input = NULL_LiveInput;
+	memset(NULL_LiveInput.pressed, 0, sizeof(NULL_LiveInput.pressed));
+	memset(NULL_LiveInput.released, 0, sizeof(NULL_LiveInput.released));
+}
+
+//-----------------------------------------------------------------------------
+const char *SYS_GetArg(const char name[])
+{
+	for ( int i = 1; i < NULL_argc; i++ )
+		if ( !strcmp(NULL_argv[i], name) )
+			return (i + 1 < NULL_argc && NULL_argv[i + 1][0] != '-') ? NULL_argv[i + 1] : "";
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+const SYS_InputState &SYS_GetInput()
+{
+	return NULL_Input;
+}
+
+//-----------------------------------------------------------------------------
+void SYS_Show()
+{
+	NULL_frame++;
+}
+
+//-----------------------------------------------------------------------------
+bool SYS_GottaQuit()
+{
+	return NULL_max_frames && NULL_frame >= NULL_max_frames;
+}
+
+//-----------------------------------------------------------------------------
+void SYS_Sleep(int /*ms*/)
+{
+	// Nothing to wait for: no display, no vsync
+}
+
+//-----------------------------------------------------------------------------
+double SYS_GetTime()
+{
+	return NULL_frame / NULL_hz;
+}
+
+//-----------------------------------------------------------------------------
+void SYS_AcquireGL()
+{
+}
+
+//-----------------------------------------------------------------------------
+void SYS_ReleaseGL()
+{
+}
+
+//-----------------------------------------------------------------------------
+bool SYS_LoadGL33()
+{
+	return true;	// The stubs in sys_null.h cover it
+}
+
+//-----------------------------------------------------------------------------
+const void *SYS_MapFile(const char filename[], size_t *size)
+{
+	int fd = open(filename, O_RDONLY | O_BINARY);
+	if ( fd == -1 )
+		return NULL;
+
+	struct stat st;
+	void *data = NULL;
+	if ( fstat(fd, &st) == 0 && st.st_size > 0 )
+	{
+#ifdef _WIN32
+		// No mmap in the CRT (bench7 on Windows): read it all instead
+		data = malloc(st.st_size);
+		if ( data && read(fd, data, st.st_size) != st.st_size )
+		{
+			free(data);
+			data = NULL;
+		}
+#else
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if ( data == MAP_FAILED )
+			data = NULL;
+#endif
+	}
+	close(fd);	// The mapping stays valid
+	if ( data )
+		*size = st.st_size;
+	return data;
+}
+
+//-----------------------------------------------------------------------------
+void SYS_UnmapFile(const void *data, size_t size)
+{
+#ifdef _WIN32
+	free((void *)data);
+#else
+	munmap((void *)data, size);
+#endif
+}
+
+//-----------------------------------------------------------------------------
+bool SYS_KeyPressed(int key)
+{
+	return key >= 0 && key < SYS_MAX_KEYS && NULL_Input.down[key];
+}
+
+//-----------------------------------------------------------------------------
+bool SYS_KeyHit(int key)
+{
+	return key >= 0 && key < SYS_MAX_KEYS && NULL_Input.pressed[key] != 0;
+}
+
+//-----------------------------------------------------------------------------
+ivec2 SYS_MousePos()
+{
+	return NULL_Input.mouse;
+}
+
+//-----------------------------------------------------------------------------
+bool SYS_MouseButtonPressed(int button)
+{
+	return SYS_KeyPressed(button);
+}
+
+//-----------------------------------------------------------------------------
+void SYS_Log(const char msg[])
+{
+	if ( NULL_verbose )
+		fputs(msg, stderr);
+}
+
+#endif // P7_NULL_PLATFORM
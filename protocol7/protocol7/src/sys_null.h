@@ -0,0 +1,201 @@
+/*
+ * sys_null.h - OpenGL/OpenAL stand-ins for the null (headless) platform
+ *
+ * There is no window, GL context or audio device on the null platform, so
+ * every GL/AL entry point the engine uses is an inline no-op here. Object
+ * generators hand out unique names so the core bookkeeping stays sane.
+ */
+#pragma once
+#ifndef	P7_SYS_NULL_H_
+#define P7_SYS_NULL_H_
+
+#include <stddef.h>
+
+#pragma region OpenGL
+// ============================================================================
+//	OpenGL types & constants (values match the real headers)
+typedef unsigned int	GLenum;
+typedef unsigned int	GLuint;
+typedef int				GLint;
+typedef int				GLsizei;
+typedef unsigned int	GLbitfield;
+typedef float			GLfloat;
+typedef double			GLdouble;
+typedef float			GLclampf;
+typedef double			GLclampd;
+typedef unsigned char	GLboolean;
+typedef void			GLvoid;
+typedef char			GLchar;
+typedef ptrdiff_t		GLsizeiptr;
+typedef ptrdiff_t		GLintptr;
+
+enum
+{
+	GL_TRIANGLE_STRIP			= 0x0005,
+	GL_QUADS					= 0x0007,
+	GL_ZERO						= 0,
+	GL_ONE						= 1,
+	GL_SRC_ALPHA				= 0x0302,
+	GL_ONE_MINUS_SRC_ALPHA		= 0x0303,
+	GL_VIEWPORT					= 0x0BA2,
+	GL_BLEND					= 0x0BE2,
+	GL_UNPACK_ALIGNMENT			= 0x0CF5,
+	GL_TEXTURE_2D				= 0x0DE1,
+	GL_UNSIGNED_BYTE			= 0x1401,
+	GL_FLOAT					= 0x1406,
+	GL_PROJECTION				= 0x1701,
+	GL_RGBA						= 0x1908,
+	GL_NEAREST					= 0x2600,
+	GL_LINEAR					= 0x2601,
+	GL_LINEAR_MIPMAP_NEAREST	= 0x2701,
+	GL_TEXTURE_MAG_FILTER		= 0x2800,
+	GL_TEXTURE_MIN_FILTER		= 0x2801,
+	GL_TEXTURE_WRAP_S			= 0x2802,
+	GL_TEXTURE_WRAP_T			= 0x2803,
+	GL_CLAMP					= 0x2900,
+	GL_REPEAT					= 0x2901,
+	GL_COLOR_BUFFER_BIT			= 0x4000,
+	GL_VERTEX_ARRAY				= 0x8074,
+	GL_COLOR_ARRAY				= 0x8076,
+	GL_TEXTURE_COORD_ARRAY		= 0x8078,
+	GL_BGRA_EXT					= 0x80E1,
+	GL_CLAMP_TO_EDGE			= 0x812F,
+	GL_R8UI						= 0x8232,
+	GL_TEXTURE0					= 0x84C0,
+	GL_TEXTURE1					= 0x84C1,
+	GL_ARRAY_BUFFER				= 0x8892,
+	GL_STREAM_DRAW				= 0x88E0,
+	GL_STATIC_DRAW				= 0x88E4,
+	GL_FRAGMENT_SHADER			= 0x8B30,
+	GL_VERTEX_SHADER			= 0x8B31,
+	GL_COMPILE_STATUS			= 0x8B81,
+	GL_LINK_STATUS				= 0x8B82,
+	GL_TEXTURE_2D_ARRAY			= 0x8C1A,
+	GL_READ_FRAMEBUFFER			= 0x8CA8,
+	GL_FRAMEBUFFER_COMPLETE		= 0x8CD5,
+	GL_COLOR_ATTACHMENT0		= 0x8CE0,
+	GL_FRAMEBUFFER				= 0x8D40,
+	GL_RED_INTEGER				= 0x8D94
+};
+
+//	Name generator shared by all GL object types
+inline GLuint NULL_GenGLName() { static GLuint last = 0; return ++last; }
+
+inline void glGenTextures(GLsizei n, GLuint *textures)	{ for (GLsizei i = 0; i < n; i++) textures[i] = NULL_GenGLName(); }
+inline void glDeleteTextures(GLsizei, const GLuint *)	{}
+inline void glBindTexture(GLenum, GLuint)				{}
+inline void glTexParameteri(GLenum, GLenum, GLint)		{}
+inline void glTexImage2D(GLenum, GLint, GLint, GLsizei, GLsizei, GLint, GLenum, GLenum, const GLvoid *) {}
+inline void glTexSubImage2D(GLenum, GLint, GLint, GLint, GLsizei, GLsizei, GLenum, GLenum, const GLvoid *) {}
+inline void glEnable(GLenum)							{}
+inline void glBlendFunc(GLenum, GLenum)					{}
+inline void glColor4f(GLfloat, GLfloat, GLfloat, GLfloat) {}
+inline void glBegin(GLenum)								{}
+inline void glEnd()										{}
+inline void glTexCoord2d(GLdouble, GLdouble)			{}
+inline void glVertex2f(GLfloat, GLfloat)				{}
+inline void glClear(GLbitfield)							{}
+inline void glClearColor(GLclampf, GLclampf, GLclampf, GLclampf) {}
+inline void glViewport(GLint, GLint, GLsizei, GLsizei)	{}
+inline void glMatrixMode(GLenum)						{}
+inline void glLoadIdentity()							{}
+inline void glPushMatrix()								{}
+inline void glPopMatrix()								{}
+inline void glGetIntegerv(GLenum, GLint *)				{}
+inline void glPixelStorei(GLenum, GLint)				{}
+inline void glOrtho(GLdouble, GLdouble, GLdouble, GLdouble, GLdouble, GLdouble) {}
+inline void glFlush()									{}
+inline void glEnableClientState(GLenum)					{}
+inline void glDisableClientState(GLenum)				{}
+inline void glVertexPointer(GLint, GLenum, GLsizei, const GLvoid *)		{}
+inline void glTexCoordPointer(GLint, GLenum, GLsizei, const GLvoid *)	{}
+inline void glColorPointer(GLint, GLenum, GLsizei, const GLvoid *)		{}
+inline void glDrawArrays(GLenum, GLint, GLsizei)		{}
+
+//	GL 3.3 (see sys_gl.h): shaders compile & link, so the modern paths run too
+inline GLuint glCreateShader(GLenum)					{ return NULL_GenGLName(); }
+inline void   glShaderSource(GLuint, GLsizei, const GLchar *const *, const GLint *) {}
+inline void   glCompileShader(GLuint)					{}
+inline void   glGetShaderiv(GLuint, GLenum, GLint *params)	{ *params = 1; }
+inline void   glDeleteShader(GLuint)					{}
+inline GLuint glCreateProgram()							{ return NULL_GenGLName(); }
+inline void   glAttachShader(GLuint, GLuint)			{}
+inline void   glLinkProgram(GLuint)						{}
+inline void   glGetProgramiv(GLuint, GLenum, GLint *params)	{ *params = 1; }
+inline void   glUseProgram(GLuint)						{}
+inline void   glDeleteProgram(GLuint)					{}
+inline GLint  glGetUniformLocation(GLuint, const GLchar *)	{ return 0; }
+inline void   glUniform1i(GLint, GLint)					{}
+inline void   glUniform4f(GLint, GLfloat, GLfloat, GLfloat, GLfloat) {}
+inline void   glGenBuffers(GLsizei n, GLuint *buffers)	{ for (GLsizei i = 0; i < n; i++) buffers[i] = NULL_GenGLName(); }
+inline void   glDeleteBuffers(GLsizei, const GLuint *)	{}
+inline void   glBindBuffer(GLenum, GLuint)				{}
+inline void   glBufferData(GLenum, GLsizeiptr, const void *, GLenum) {}
+inline void   glBufferSubData(GLenum, GLintptr, GLsizeiptr, const void *) {}
+inline void   glGenVertexArrays(GLsizei n, GLuint *arrays)	{ for (GLsizei i = 0; i < n; i++) arrays[i] = NULL_GenGLName(); }
+inline void   glDeleteVertexArrays(GLsizei, const GLuint *)	{}
+inline void   glBindVertexArray(GLuint)					{}
+inline void   glEnableVertexAttribArray(GLuint)			{}
+inline void   glVertexAttribPointer(GLuint, GLint, GLenum, GLboolean, GLsizei, const void *) {}
+inline void   glVertexAttribDivisor(GLuint, GLuint)		{}
+inline void   glDrawArraysInstanced(GLenum, GLint, GLsizei, GLsizei) {}
+inline void   glGenFramebuffers(GLsizei n, GLuint *fbos)	{ for (GLsizei i = 0; i < n; i++) fbos[i] = NULL_GenGLName(); }
+inline void   glDeleteFramebuffers(GLsizei, const GLuint *)	{}
+inline void   glBindFramebuffer(GLenum, GLuint)			{}
+inline void   glFramebufferTexture2D(GLenum, GLenum, GLenum, GLuint, GLint) {}
+inline GLenum glCheckFramebufferStatus(GLenum)			{ return GL_FRAMEBUFFER_COMPLETE; }
+inline void   glUniform2f(GLint, GLfloat, GLfloat)		{}
+inline void   glActiveTexture(GLenum)					{}
+inline void   glTexImage3D(GLenum, GLint, GLint, GLsizei, GLsizei, GLsizei, GLint, GLenum, GLenum, const void *) {}
+inline void   glCopyTexSubImage3D(GLenum, GLint, GLint, GLint, GLint, GLint, GLint, GLsizei, GLsizei) {}
+#pragma endregion
+
+#pragma region OpenAL
+// ============================================================================
+//	OpenAL types & constants (values match the real headers)
+typedef unsigned int	ALuint;
+typedef int				ALint;
+typedef int				ALsizei;
+typedef int				ALenum;
+typedef float			ALfloat;
+typedef char			ALCchar;
+typedef int				ALCint;
+typedef void			ALvoid;
+struct ALCdevice;
+struct ALCcontext;
+
+enum
+{
+	AL_TRUE				= 1,
+	AL_PITCH			= 0x1003,
+	AL_LOOPING			= 0x1007,
+	AL_BUFFER			= 0x1009,
+	AL_GAIN				= 0x100A,
+	AL_FORMAT_MONO8		= 0x1100,
+	AL_FORMAT_MONO16	= 0x1101,
+	AL_FORMAT_STEREO8	= 0x1102,
+	AL_FORMAT_STEREO16	= 0x1103
+};
+
+//	No audio device: CORE_InitSound() fails and everything else is ignored
+inline ALCdevice  *alcOpenDevice(const ALCchar *)					{ return 0; }
+inline ALCcontext *alcCreateContext(ALCdevice *, const ALCint *)	{ return 0; }
+inline bool        alcMakeContextCurrent(ALCcontext *)				{ return false; }
+inline ALCcontext *alcGetCurrentContext()							{ return 0; }
+inline ALCdevice  *alcGetContextsDevice(ALCcontext *)				{ return 0; }
+inline void        alcDestroyContext(ALCcontext *)					{}
+inline bool        alcCloseDevice(ALCdevice *)						{ return false; }
+
+inline void   alGenSources(ALsizei n, ALuint *sources)	{ for (ALsizei i = 0; i < n; i++) sources[i] = 0; }
+inline void   alDeleteSources(ALsizei, const ALuint *)	{}
+inline void   alGenBuffers(ALsizei n, ALuint *buffers)	{ for (ALsizei i = 0; i < n; i++) buffers[i] = NULL_GenGLName(); }
+inline void   alDeleteBuffers(ALsizei, const ALuint *)	{}
+inline void   alBufferData(ALuint, ALenum, const ALvoid *, ALsizei, ALsizei) {}
+inline ALenum alGetError()								{ return 0; }
+inline void   alSourcei(ALuint, ALenum, ALint)			{}
+inline void   alSourcef(ALuint, ALenum, ALfloat)		{}
+inline void   alSourcePlay(ALuint)						{}
+inline void   alSourceStop(ALuint)						{}
+#pragma endregion
+
+#endif // !P7_SYS_NULL_H_
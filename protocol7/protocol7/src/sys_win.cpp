@@ -14,6 +14,29 @@ HWND      WIN_hWnd = 0;
 HDC       WIN_hDC = 0;
 HGLRC     WIN_hGLRC = 0;
 bool      WIN_bGottaQuit = false;
+LONGLONG  WIN_llPerfFreq = 1;
+LONGLONG  WIN_llPerfStart = 0;
+#pragma endregion
+
+#pragma region Input
+SYS_InputState WIN_Input;		// Snapshot handed to the game by SYS_Pump
+SYS_InputState WIN_LiveInput;	// Updated as window messages are dispatched
+
+//-----------------------------------------------------------------------------
+void WIN_KeyEvent(int key, bool down)
+{
+	if ( key < 0 || key >= SYS_MAX_KEYS || WIN_LiveInput.down[key] == down )
+		return;
+
+	byte &count = down ? WIN_LiveInput.pressed[key] : WIN_LiveInput.released[key];
+	if ( count < 0xFF )
+		count++;
+	WIN_LiveInput.down[key] = down;
+
+	// Message time is GetTickCount() based, rebase it on our clock
+	DWORD age_ms = GetTickCount() - (DWORD)GetMessageTime();
+	WIN_LiveInput.event_time[key] = SYS_GetTime() - age_ms / 1000.0;
+}
 #pragma endregion
 
 //-----------------------------------------------------------------------------
@@ -26,6 +49,27 @@ LRESULT CALLBACK WIN_WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lPar
 	{
 	case WM_PAINT:   hdc = BeginPaint(hWnd, &ps); EndPaint(hWnd, &ps); break;
 	case WM_DESTROY: PostQuitMessage(0); break;
+
+	// Input: bit 30 of lParam is set on auto-repeat, which we don't want as edges
+	case WM_KEYDOWN:     if ( !(lParam & (1 << 30)) ) WIN_KeyEvent((int)wParam, true); break;
+	case WM_KEYUP:       WIN_KeyEvent((int)wParam, false); break;
+	case WM_SYSKEYDOWN:  if ( !(lParam & (1 << 30)) ) WIN_KeyEvent((int)wParam, true); return DefWindowProc(hWnd, message, wParam, lParam);
+	case WM_SYSKEYUP:    WIN_KeyEvent((int)wParam, false); return DefWindowProc(hWnd, message, wParam, lParam);
+	case WM_LBUTTONDOWN: WIN_KeyEvent(VK_LBUTTON, true); break;
+	case WM_LBUTTONUP:   WIN_KeyEvent(VK_LBUTTON, false); break;
+	case WM_RBUTTONDOWN: WIN_KeyEvent(VK_RBUTTON, true); break;
+	case WM_RBUTTONUP:   WIN_KeyEvent(VK_RBUTTON, false); break;
+	case WM_MBUTTONDOWN: WIN_KeyEvent(VK_MBUTTON, true); break;
+	case WM_MBUTTONUP:   WIN_KeyEvent(VK_MBUTTON, false); break;
+	case WM_MOUSEMOVE:
+		WIN_LiveInput.mouse.x = (short)LOWORD(lParam);
+		WIN_LiveInput.mouse.y = (int)SYS_HEIGHT - (short)HIWORD(lParam);
+		break;
+	case WM_KILLFOCUS:
+		for ( int i = 0; i < SYS_MAX_KEYS; i++ )
+			WIN_KeyEvent(i, false);
+		break;
+
 	default:         return DefWindowProc(hWnd, message, wParam, lParam);
 	}
 
@@ -91,6 +135,13 @@ void WIN_EnableOpenGL()
 	// Create and enable the render context (RC)
 	WIN_hGLRC = wglCreateContext(WIN_hDC);
 	wglMakeCurrent(WIN_hDC, WIN_hGLRC);
+
+	// Sync SwapBuffers to the display refresh if the driver lets us
+	typedef BOOL (WINAPI *PFNWGLSWAPINTERVALEXTPROC)(int interval);
+	PFNWGLSWAPINTERVALEXTPROC wglSwapIntervalEXT =
+		(PFNWGLSWAPINTERVALEXTPROC)wglGetProcAddress("wglSwapIntervalEXT");
+	if ( wglSwapIntervalEXT )
+		wglSwapIntervalEXT(1);
 }
 
 //-----------------------------------------------------------------------------
@@ -101,11 +152,46 @@ void WIN_DisableOpenGL()
 	ReleaseDC(WIN_hWnd, WIN_hDC);
 }
 
+//-----------------------------------------------------------------------------
+// Command line, split in place into whitespace separated (optionally quoted) args
+static const int WIN_MAX_ARGS = 32;
+char  WIN_szArgs[1024];
+char *WIN_pArgs[WIN_MAX_ARGS];
+int   WIN_nArgs = 0;
+
+void WIN_ParseArgs(const char cmdline[])
+{
+	strncpy(WIN_szArgs, cmdline, sizeof(WIN_szArgs) - 1);
+	char *p = WIN_szArgs;
+	while ( WIN_nArgs < WIN_MAX_ARGS )
+	{
+		while ( *p == ' ' || *p == '\t' )
+			p++;
+		if ( !*p )
+			break;
+
+		char end = ' ';
+		if ( *p == '"' )
+			end = *p++;
+		WIN_pArgs[WIN_nArgs++] = p;
+		while ( *p && *p != end && (end == '"' || *p != '\t') )
+			p++;
+		if ( *p )
+			*p++ = '\0';
+	}
+}
+
 //-----------------------------------------------------------------------------
 int APIENTRY WinMain(HINSTANCE hI, HINSTANCE hPrevI, LPSTR lpCmdLine, int nCS)
 {
 	WIN_hInst = hI;
 	WIN_nCmdShow = nCS;
+	WIN_ParseArgs(lpCmdLine);
+
+	LARGE_INTEGER li;
+	QueryPerformanceFrequency(&li); WIN_llPerfFreq = li.QuadPart;
+	QueryPerformanceCounter(&li);   WIN_llPerfStart = li.QuadPart;
+
 	if ( !WIN_RegisterClass() ) return -1;
 	if ( !WIN_InitInstance() ) return -1;
 	WIN_EnableOpenGL();
@@ -130,6 +216,27 @@ void SYS_Pump()
 			DispatchMessage(&msg);
 		}
 	}
+
+	// Take the input snapshot, edges start over from here
+	WIN_LiveInput.time = SYS_GetTime();
+	WIN_Input = WIN_LiveInput;
+	memset(WIN_LiveInput.pressed, 0, sizeof(WIN_LiveInput.pressed));
+	memset(WIN_LiveInput.released, 0, sizeof(WIN_LiveInput.released));
+}
+
+//-----------------------------------------------------------------------------
+const char *SYS_GetArg(const char name[])
+{
+	for ( int i = 0; i < WIN_nArgs; i++ )
+		if ( !strcmp(WIN_pArgs[i], name) )
+			return (i + 1 < WIN_nArgs && WIN_pArgs[i + 1][0] != '-') ? WIN_pArgs[i + 1] : "";
+	return NULL;
+}
+
+//-----------------------------------------------------------------------------
+const SYS_InputState &SYS_GetInput()
+{
+	return WIN_Input;
 }
 
 //-----------------------------------------------------------------------------
@@ -151,25 +258,103 @@ void SYS_Sleep(int ms)
 	Sleep(ms);
 }
 
+//-----------------------------------------------------------------------------
+double SYS_GetTime()
+{
+	LARGE_INTEGER li;
+	QueryPerformanceCounter(&li);
+	return (double)(li.QuadPart - WIN_llPerfStart) / (double)WIN_llPerfFreq;
+}
+
+//-----------------------------------------------------------------------------
+void SYS_AcquireGL()
+{
+	wglMakeCurrent(WIN_hDC, WIN_hGLRC);
+}
+
+//-----------------------------------------------------------------------------
+void SYS_ReleaseGL()
+{
+	wglMakeCurrent(NULL, NULL);
+}
+
+//-----------------------------------------------------------------------------
+#define SYS_GL_DEFINE(ret, name, args) name##_proc name = NULL;
+SYS_GL33_PROCS(SYS_GL_DEFINE)
+#undef SYS_GL_DEFINE
+
+bool SYS_LoadGL33()
+{
+	// The legacy context reports the highest version it supports
+	int major = 0, minor = 0;
+	const char *version = (const char *)glGetString(GL_VERSION);
+	if ( !version || sscanf(version, "%d.%d", &major, &minor) != 2 || major * 10 + minor < 33 )
+		return false;
+
+	bool ok = true;
+#define SYS_GL_LOAD(ret, name, args) ok &= (name = (name##_proc)wglGetProcAddress(#name)) != NULL;
+	SYS_GL33_PROCS(SYS_GL_LOAD)
+#undef SYS_GL_LOAD
+	return ok;
+}
+
+//-----------------------------------------------------------------------------
+const void *SYS_MapFile(const char filename[], size_t *size)
+{
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if ( file == INVALID_HANDLE_VALUE )
+		return NULL;
+
+	// The view keeps the mapping alive, the handles can go right away
+	const void *data = NULL;
+	LARGE_INTEGER file_size;
+	if ( GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0 && (qword)file_size.QuadPart <= (size_t)-1 )
+	{
+		HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if ( mapping )
+		{
+			data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);
+		}
+	}
+	CloseHandle(file);
+	if ( data )
+		*size = (size_t)file_size.QuadPart;
+	return data;
+}
+
+//-----------------------------------------------------------------------------
+void SYS_UnmapFile(const void *data, size_t size)
+{
+	UnmapViewOfFile(data);
+}
+
 //-----------------------------------------------------------------------------
 bool SYS_KeyPressed(int key)
 {
-	return GetFocus() == WIN_hWnd && (GetAsyncKeyState(key) & 0x8000) != 0;
+	return key >= 0 && key < SYS_MAX_KEYS && WIN_Input.down[key];
+}
+
+//-----------------------------------------------------------------------------
+bool SYS_KeyHit(int key)
+{
+	return key >= 0 && key < SYS_MAX_KEYS && WIN_Input.pressed[key] != 0;
 }
 
 //-----------------------------------------------------------------------------
 ivec2 SYS_MousePos()
 {
-	POINT pt;
-	GetCursorPos(&pt);
-	ScreenToClient(WIN_hWnd, &pt);
+	return WIN_Input.mouse;
+}
 
-	ivec2 r = {pt.x, (int)SYS_HEIGHT - pt.y};
-	return r;
+//-----------------------------------------------------------------------------
+bool SYS_MouseButtonPressed(int button)
+{
+	return SYS_KeyPressed(button);
 }
 
 //-----------------------------------------------------------------------------
-bool  SYS_MouseButonPressed(int button)
+void SYS_Log(const char msg[])
 {
-	return GetFocus() == WIN_hWnd && (GetAsyncKeyState(button) & 0x8000) != 0;
-}
\ No newline at end of file
+	OutputDebugStringA(msg);
+}